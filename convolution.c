@@ -8,18 +8,50 @@
 // The program accepts an PPM image file, a text definition of the kernel matrix and the PPM file for storing the convolution results.
 // The program allows to define image partitions for processing large images (>500MB)
 // The 2D image is represented by 1D vector for chanel R, G and B. The convolution is applied to each chanel separately.
+// Both text (P3) and binary (P6) PPM images are accepted, binary ones with 8-bit or 16-bit samples (maxcolor > 255).
+// Text images are memory mapped and their samples decoded with a SIMD parser instead of fscanf,
+// in parallel over byte ranges of the file. Optionally the parsed samples are kept in a binary
+// planar sidecar file (<image>.cache) that later runs map instead of parsing the text again.
+// Text results are formatted in parallel with a table-driven itoa and written with a few large writes.
+// The partitions can be processed in a pipeline, reading and writing chunks while others are convolved,
+// or the whole image can be streamed row by row keeping only kernelY rows in memory.
+// A bank of kernels can be applied in the same run, every chunk is read once and every strip of its rows is
+// convolved with all of them while it is in cache.
+// A chain of kernels is composed into one kernel, or applied stage by stage on strips of rows when that is cheaper.
+// "-" reads the source image from stdin and/or writes the result to stdout, in one forward pass.
+// Binary results in a regular file are preallocated and every thread writes its rows at their offset.
+// Samples are stored as uint8 or uint16 depending on maxcolor, and results are saturated to [0, maxcolor].
+// The convolution is vectorized across output columns with the widest SIMD engine the CPU supports.
+// Kernels of integral taps can be applied with exact integer sums, in 16-bit multiply-adds.
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #include <time.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
 #include <omp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <complex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_ENGINES                     // SSE4.2, AVX2 and AVX-512 engines selected at run time
+#endif
 
 #define MAX(a, b)((a > b) ? a : b )  
 #define MIN(a, b)((a < b) ? a : b )  
+#define PATH_MAX_CACHE 1024
 
 // Estructura per emmagatzemar el contingut d'una imatge.
 struct imagenppm{
@@ -28,69 +60,223 @@ struct imagenppm{
     char *comentario;
     int maxcolor;
     int P;
-    int *R;
-    int *G;
-    int *B;
+    void *R;            // Planes of sampleBytes() bytes per sample: uint8 or uint16
+    void *G;
+    void *B;
+    long body;          // File offset where the pixel data starts (0 for cached images)
+    char *map;          // Memory mapped source file (text images), NULL when not mapped
+    size_t mapsize;
+    int nranges;        // Byte ranges of the mapped text for the parallel parser
+    long *rangeStart;   // File offset where every range starts (nranges+1 entries)
+    long *rangeSample;  // Index of the first sample of every range (prefix sum of the counts)
+    long lastPosition;  // Last position returned by readImage and the index of its sample
+    long lastSample;
+    unsigned char *cache; // Mapped sidecar cache with the planar samples, NULL when not used
+    size_t cachesize;
+    int pipe;           // Source that can not seek (stdin pipe): read forward only, without position
+    char *pipebuf;      // Buffered text of a piped source and the parsed/valid bytes in it
+    size_t pipepos, pipelen;
+    int pipeeof;
+    int positional;     // Result file preallocated: binary chunks are written at their offset with pwrite
+    long stored;        // Pixels of the result stored so far
 };
 typedef struct imagenppm* ImagenData;
 
+// Narrow samples. Hot loops take the sample size as a constant and are specialized for both sizes.
+typedef unsigned char  sample8;
+typedef unsigned short sample16;
+#define GET_SAMPLE(plane, i, bytes) ((bytes) == 1 ? ((const sample8 *)(plane))[i] : ((const sample16 *)(plane))[i])
+#define SET_SAMPLE(plane, i, bytes, v) do { if ((bytes) == 1) ((sample8 *)(plane))[i] = (v); \
+                                            else ((sample16 *)(plane))[i] = (v); } while (0)
+#define PLANE_AT(plane, i, bytes) ((void *)((char *)(plane) + (size_t)(i)*(bytes)))
+#define SATURATE(v, maxcolor) MIN(MAX((v), 0), (maxcolor))
+
+// Header of the sidecar cache file. It is followed by the R, G and B planes of altura*ancho
+// samples each, stored with sampleBytes() bytes in the host byte order.
+#define CACHE_MAGIC "PPMCACH1"
+struct cacheheader{
+    char magic[8];
+    long long srcsize;  // Size and modification time of the source the cache was built from
+    long long mtime;
+    long long mtimensec;
+    int ancho;
+    int altura;
+    int maxcolor;
+    int bytes;
+    char source[PATH_MAX_CACHE];
+    char comentario[300];
+};
+
 // Estructura per emmagatzemar el contingut d'un kernel.
 struct structkernel{
     int kernelX;
     int kernelY;
     float *vkern;
+    int separable;      // vkern[m*kernelX+n] == vcol[m]*vrow[n] within SEPARABLE_TOLERANCE
+    float *vcol;
+    float *vrow;
+    int fftsize;        // FFT size of the cached spectrum, 0 if none
+    double complex *spectrum;   // Transposed 2D FFT of the kernel zero padded to fftsize x fftsize
+    double complex *twiddle;
+    int *bitrev;
+    int ntaps;          // Nonzero taps of a sparse kernel, 0 if it is too dense to list them
+    int *tapPos;        // Row and column of every nonzero tap, tapPos[2*i] and tapPos[2*i+1]
+    float *tapWeight;
+    int hsym, vsym, psym; // Left-right, top-bottom and point symmetry: 1, -1 antisymmetric, 0 none
+    int nstages;        // Kernels of a chain, vkern being their composition, 0 if it is not a chain
+    struct structkernel **stages;
+    int box;            // All the taps are equal, the sums are read from a summed-area table
+    double sigmaX, sigmaY; // Standard deviations of a Gaussian kernel applied recursively, 0 if it is not one
+    double gain;        // Sum of the taps of the Gaussian kernel
+    int *pairs;         // Taps of an integral kernel packed for the integer engines, NULL if it is not integral
+    long long tapSum, rowSum; // Sum of the absolute taps of the integral kernel and of its largest row
+    int method;         // Convolution method planned for the chunks (enum method)
 };
 typedef struct structkernel* kernelData;
 
+// Convolution methods, chosen by the planner
+enum method {METHOD_DIRECT, METHOD_SPARSE, METHOD_SYMMETRIC, METHOD_SEPARABLE, METHOD_WINOGRAD, METHOD_FFT, METHOD_BOX, METHOD_GAUSSIAN, METHOD_FUSED, METHOD_INTEGER, METHODS};
+
 //Functions Definition
-ImagenData initimage(char* nombre, FILE **fp, int partitions, int halo);
+ImagenData initimage(char* nombre, FILE **fp, int partitions, int halo, int usecache);
 ImagenData duplicateImageData(ImagenData src, int partitions, int halo);
 
 int readImage(ImagenData Img, FILE **fp, int dim, int halosize, long int *position);
 int duplicateImageChunk(ImagenData src, ImagenData dst, int dim);
 int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position);
 int savingChunk(ImagenData img, FILE **fp, int dim, int offset);
-int convolve2D(int* inbuf, int* outbuf, int sizeX, int sizeY, float* kernel, int ksizeX, int ksizeY);
+int sampleBytes(ImagenData img);
+int mapImage(ImagenData img, FILE *fp);
+const char *parseTextSamples(const char *p, const char *end, void **planes, int bytes, int maxcolor, long first, long n);
+int indexText(ImagenData img);
+long countTokens(const char *p, const char *end);
+int readPipedText(ImagenData img, FILE **fp, int dim);
+int readTextChunk(ImagenData img, int dim, int haloposition, long *position);
+int openCache(ImagenData img, char *nombre, struct stat *st);
+int buildCache(ImagenData img, char *nombre, struct stat *st);
+int readCachedChunk(ImagenData img, int dim, int haloposition, long *position);
+int readBinaryChunk(ImagenData img, FILE **fp, int dim);
+int savingBinaryChunk(ImagenData img, FILE **fp, int dim, int offset);
+unsigned char *encodePixels(unsigned char *b, ImagenData img, int from, int to);
+char *formatPixels(char *p, ImagenData img, int from, int to);
+int writeAll(int fd, struct iovec *iov, int n);
+const char *selectEngine(const char *isa);
+kernelData leerKernel(char* nombre);
+kernelData leerChain(char* nombre);
+int chainKernels(kernelData kern, kernelData *stages, int nstages);
+int factorKernel(kernelData kern);
+int compileTaps(kernelData kern);
+void findSymmetry(kernelData kern);
+void findBlur(kernelData kern);
+int integerTaps(kernelData kern);
+int integerPossible(kernelData kern, int maxcolor);
+int convolve2D(void** inbuf, void** outbuf, int sizeX, int sizeY, float* kernel, int ksizeX, int ksizeY, int bytes, int maxcolor);
+int convolveSparse2D(void** inbuf, void** outbuf, int sizeX, int sizeY, kernelData kern, int bytes, int maxcolor);
+int convolveInteger2D(void** inbuf, void** outbuf, int sizeX, int sizeY, kernelData kern, int bytes, int maxcolor);
+int convolveSymmetric2D(void** inbuf, void** outbuf, int sizeX, int sizeY, kernelData kern, int bytes, int maxcolor);
+int convolveSeparable2D(void** inbuf, void** outbuf, int sizeX, int sizeY, float* vcol, float* vrow, int ksizeX, int ksizeY, int bytes, int maxcolor);
+int convolveWinograd2D(void** inbuf, void** outbuf, int sizeX, int sizeY, float* kernel, int bytes, int maxcolor);
+int convolveFFT2D(void** inbuf, void** outbuf, int sizeX, int sizeY, kernelData kern, int bytes, int maxcolor);
+int convolveBox2D(void** inbuf, void** outbuf, int sizeX, int sizeY, kernelData kern, int bytes, int maxcolor);
+int convolveGaussian2D(void** inbuf, void** outbuf, int sizeX, int sizeY, kernelData kern, int bytes, int maxcolor);
+int convolveFused2D(void** inbuf, void** outbuf, int sizeX, int sizeY, kernelData kern, int bytes, int maxcolor);
+int loadProfile(const char *engine);
+int methodByName(const char *name);
+double methodCost(kernelData kern, int method, int dataSizeX, int dataSizeY, int maxcolor, int threads);
+int planKernel(kernelData kern, int dataSizeX, int dataSizeY, int maxcolor, int threads, int forced, FILE *info);
+int calibrate(const char *engine);
+int convolveChunk(void** inbuf, void** outbuf, int sizeX, int sizeY, kernelData kern, int bytes, int maxcolor);
+int bankStrip(kernelData *bank, int nbank, int sizeX, int bytes, int *top, int *bottom);
+int convolveBank(void** inbuf, void** outbuf, int sizeX, int sizeY, kernelData *bank, int nbank, int bytes, int maxcolor);
 void freeImagestructure(ImagenData *src);
+void chunkGeometry(int c, int partitions, int halo, int ancho, int partsize, int *halosize, int *chunksize, int *offset);
+int convolveRow(void** rows, void** out, int dataSizeX, float* window, float* kernel, int kernelSizeX, int kernelSizeY, int bytes, int maxcolor);
+size_t convolveRowWindow(int dataSizeX, int kernelSizeX, int kernelSizeY);
 
-//Open Image file and image struct initialization
-ImagenData initimage(char* nombre, FILE **fp,int partitions, int halo){
-    char c;
+//Open Image file and image struct initialization. With 0 partitions the planes are not allocated.
+ImagenData initimage(char* nombre, FILE **fp,int partitions, int halo, int usecache){
+    char magic;
+    int c;
     char comentario[300];
     int i=0,chunk=0;
     ImagenData img=NULL;
     
     /*Se habre el fichero ppm*/
 
-    if ((*fp=fopen(nombre,"r"))==NULL){
+    if (strcmp(nombre,"-") == 0) *fp = stdin;
+    else *fp = fopen(nombre,"r");
+    if (*fp == NULL){
         perror("Error: ");
     }
     else{
         //Memory allocation
         img=(ImagenData) malloc(sizeof(struct imagenppm));
 
-        //Reading the first line: Magical Number "P3"
-        fscanf(*fp,"%c%d ",&c,&(img->P));
+        //Reading the first line: Magical Number "P3" (text) or "P6" (binary)
+        fscanf(*fp,"%c%d ",&magic,&(img->P));
+        if (magic != 'P' || (img->P != 3 && img->P != 6)) {
+            fprintf(stderr,"Error: %s is not a P3 or P6 PPM image\n",nombre);
+            free(img);
+            return NULL;
+        }
         
-        //Reading the image comment
-        while((c=fgetc(*fp))!= '\n'){comentario[i]=c;i++;}
+        //Reading the image comment (with its '#'). Only the first comment line is kept.
+        while((c=fgetc(*fp)) == '#'){
+            int first = (i == 0);
+            do { if (first && i<299) {comentario[i]=c;i++;} } while((c=fgetc(*fp))!= '\n' && c != EOF);
+            while (c == '\n' || c == ' ' || c == '\r' || c == '\t') c=fgetc(*fp);
+            ungetc(c,*fp);
+        }
+        ungetc(c,*fp);
         comentario[i]='\0';
         //Allocating information for the image comment
-        img->comentario = calloc(strlen(comentario),sizeof(char));
+        img->comentario = calloc(strlen(comentario)+1,sizeof(char));
         strcpy(img->comentario,comentario);
         //Reading image dimensions and color resolution
         fscanf(*fp,"%d %d %d",&img->ancho,&img->altura,&img->maxcolor);
+        if (img->maxcolor <= 0 || img->maxcolor > 65535) {
+            fprintf(stderr,"Error: %s has an invalid maxcolor %d\n",nombre,img->maxcolor);
+            free(img->comentario);
+            free(img);
+            return NULL;
+        }
+        //A single whitespace separates the header from the binary samples
+        if (img->P == 6) fgetc(*fp);
+        img->body = ftell(*fp);
+        img->map = NULL;
+        img->mapsize = 0;
+        img->nranges = 0;
+        img->rangeStart = img->rangeSample = NULL;
+        img->cache = NULL;
+        img->cachesize = 0;
+        img->pipe = (lseek(fileno(*fp), 0, SEEK_CUR) < 0);
+        img->pipebuf = NULL;
+        img->pipepos = img->pipelen = 0;
+        img->pipeeof = 0;
+        if (img->P == 3 && !img->pipe) {
+            struct stat st;
+            // A valid sidecar cache replaces the text parsing. Otherwise it is built from the text.
+            // No cache for stdin or for a source that can not be stat'ed.
+            if (usecache && (strcmp(nombre,"-") == 0 || stat(nombre, &st) != 0)) usecache = 0;
+            if (usecache && openCache(img, nombre, &st) == 0) img->body = 0;
+            else if (mapImage(img, *fp) == 0) {
+                indexText(img);
+                if (usecache && buildCache(img, nombre, &st) == 0 && openCache(img, nombre, &st) == 0) img->body = 0;
+            }
+        }
+        img->R = img->G = img->B = NULL;
+        if (partitions == 0) return img;
         chunk = img->ancho*img->altura / partitions;
         //We need to read an extra row.
         chunk = chunk + img->ancho * halo;
-        if ((img->R=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-        if ((img->G=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-        if ((img->B=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
+        if ((img->R=calloc(chunk,sampleBytes(img))) == NULL) {return NULL;}
+        if ((img->G=calloc(chunk,sampleBytes(img))) == NULL) {return NULL;}
+        if ((img->B=calloc(chunk,sampleBytes(img))) == NULL) {return NULL;}
     }
     return img;
 }
 
-//Duplicate the Image struct for the resulting image
+//Duplicate the Image struct for the resulting image. With 0 partitions the planes are not allocated.
 ImagenData duplicateImageData(ImagenData src, int partitions, int halo){
     char c;
     char comentario[300];
@@ -101,57 +287,473 @@ ImagenData duplicateImageData(ImagenData src, int partitions, int halo){
 
     //Copying the magic number
     dst->P=src->P;
+    dst->body=src->body;
+    dst->map=NULL;
+    dst->mapsize=0;
+    dst->nranges=0;
+    dst->rangeStart=dst->rangeSample=NULL;
+    dst->cache=NULL;
+    dst->cachesize=0;
+    dst->pipe=0;
+    dst->pipebuf=NULL;
+    dst->positional=0;
+    dst->stored=0;
     //Copying the string comment
-    dst->comentario = calloc(strlen(src->comentario),sizeof(char));
+    dst->comentario = calloc(strlen(src->comentario)+1,sizeof(char));
     strcpy(dst->comentario,src->comentario);
     //Copying image dimensions and color resolution
     dst->ancho=src->ancho;
     dst->altura=src->altura;
     dst->maxcolor=src->maxcolor;
+    dst->R = dst->G = dst->B = NULL;
+    if (partitions == 0) return dst;
     chunk = dst->ancho*dst->altura / partitions;
     //We need to read an extra row.
     chunk = chunk + src->ancho * halo;
-    if ((dst->R=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    if ((dst->G=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    if ((dst->B=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
+    if ((dst->R=calloc(chunk,sampleBytes(dst))) == NULL) {return NULL;}
+    if ((dst->G=calloc(chunk,sampleBytes(dst))) == NULL) {return NULL;}
+    if ((dst->B=calloc(chunk,sampleBytes(dst))) == NULL) {return NULL;}
     return dst;
 }
 
-//Read the corresponding chunk from the source Image
+//Read the corresponding chunk from the source Image. position is the file offset where the chunk starts
+//(a pixel index for cached images) and it is updated to the start of the next chunk, its halo included.
 int readImage(ImagenData img, FILE **fp, int dim, int halosize, long *position){
-    int i=0, k=0,haloposition=0;
+    int i=0, k=0,haloposition=0, bytes=sampleBytes(img);
+    // A pipe is read forward only, chunks must come one after the other without halos.
+    if (img->pipe) {
+        if (img->P == 6) return readBinaryChunk(img, fp, dim);
+        return readPipedText(img, fp, dim);
+    }
     if (fseek(*fp,*position,SEEK_SET))
         perror("Error: ");
     haloposition = dim-(img->ancho*halosize*2);
+    // Without halo the next chunk starts right after this one
+    if (halosize == 0) haloposition = dim;
+    // Binary samples have a fixed size, so the halo position is known without parsing.
+    if (img->P == 6) {
+        *position = *position + (long)haloposition*3*sampleBytes(img);
+        return readBinaryChunk(img, fp, dim);
+    }
+    // Cached image: the position is a pixel index, so seeking is immediate.
+    if (img->cache != NULL) {
+        return readCachedChunk(img, dim, haloposition, position);
+    }
+    // Mapped text image: parse the samples straight from memory.
+    if (img->map != NULL && img->nranges > 1) {
+        return readTextChunk(img, dim, haloposition, position);
+    }
+    if (img->map != NULL) {
+        void *planes[3] = {img->R, img->G, img->B};
+        const char *p = img->map + *position, *end = img->map + img->mapsize;
+        if ((p = parseTextSamples(p, end, planes, bytes, img->maxcolor, 0, (long)haloposition*3)) == NULL) return -1;
+        *position = p - img->map;
+        if (parseTextSamples(p, end, planes, bytes, img->maxcolor, (long)haloposition*3, (long)(dim-haloposition)*3) == NULL) return -1;
+        return 0;
+    }
     for(i=0;i<dim;i++) {
+        int v[3];
         // When start reading the halo store the position in the image file
-        if (halosize != 0 && i == haloposition) *position=ftell(*fp);
-        fscanf(*fp,"%d %d %d ",&img->R[i],&img->G[i],&img->B[i]);
+        if (i == haloposition) *position=ftell(*fp);
+        fscanf(*fp,"%d %d %d ",&v[0],&v[1],&v[2]);
+        SET_SAMPLE(img->R, i, bytes, SATURATE(v[0], img->maxcolor));
+        SET_SAMPLE(img->G, i, bytes, SATURATE(v[1], img->maxcolor));
+        SET_SAMPLE(img->B, i, bytes, SATURATE(v[2], img->maxcolor));
         k++;
     }
+    if (haloposition == dim) *position=ftell(*fp);
 //    printf ("Readed = %d pixels, posicio=%lu\n",k,*position);
     return 0;
 }
 
+// Bytes used by every sample in the planes and in a binary (P6) image: 1 up to maxcolor 255,
+// 2 (big endian in P6) up to 65535.
+int sampleBytes(ImagenData img){
+    return (img->maxcolor < 256) ? 1 : 2;
+}
+
+//Read dim pixels of raw rows from a binary image, starting at the current file position.
+int readBinaryChunk(ImagenData img, FILE **fp, int dim){
+    int i, n, done=0, bytes=sampleBytes(img);
+    int block = img->ancho*64;                      // pixels decoded per fread
+    unsigned char *buf, *b;
+    
+    if (block > dim) block = dim;
+    if ((buf=malloc((size_t)block*3*bytes)) == NULL) return -1;
+    while (done < dim) {
+        n = MIN(block, dim-done);
+        if (fread(buf, 3*bytes, n, *fp) != (size_t)n) {
+            fprintf(stderr,"Error: unexpected end of the binary image data\n");
+            free(buf);
+            return -1;
+        }
+        b = buf;
+        if (bytes == 1) {
+            sample8 *R = img->R, *G = img->G, *B = img->B;
+            for(i=done;i<done+n;i++,b+=3) {
+                R[i] = SATURATE(b[0], img->maxcolor); G[i] = SATURATE(b[1], img->maxcolor); B[i] = SATURATE(b[2], img->maxcolor);
+            }
+        }
+        else {
+            sample16 *R = img->R, *G = img->G, *B = img->B;
+            for(i=done;i<done+n;i++,b+=6) {
+                R[i] = SATURATE((b[0]<<8)|b[1], img->maxcolor);
+                G[i] = SATURATE((b[2]<<8)|b[3], img->maxcolor);
+                B[i] = SATURATE((b[4]<<8)|b[5], img->maxcolor);
+            }
+        }
+        done += n;
+    }
+    free(buf);
+    return 0;
+}
+
+// Map the whole source file in memory. On failure (e.g. the file is a pipe) the stdio reader is used.
+int mapImage(ImagenData img, FILE *fp){
+    struct stat st;
+    void *m;
+    
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return -1;
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (m == MAP_FAILED) return -1;
+    madvise(m, st.st_size, MADV_SEQUENTIAL);
+    img->map = m;
+    img->mapsize = st.st_size;
+    return 0;
+}
+
+// Convert the len (1..8) ASCII digits at p in a single 64-bit register (SWAR).
+// The digits are aligned to the most significant bytes, so the missing ones act as leading zeros,
+// and then pairs, quads and octets of digits are combined with one multiplication each.
+// Bytes after the token are discarded by the shift, so p[0..7] only has to be readable.
+static inline int swarDigits(const char *p, int len){
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    v = (v - 0x3030303030303030ULL) << (8*(8-len));
+    v = ((v & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    v = ((v & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    v = ((v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+    return (int)v;
+}
+
+// Scalar decoding of one (optionally negative) decimal sample of len characters.
+static inline int scalarSample(const char *p, int len){
+    long v = 0;
+    int i, neg = (*p == '-');
+    for (i=neg;i<len;i++) v = v*10 + (p[i]-'0');
+    return (int)(neg ? -v : v);
+}
+
+static inline int decodeSample(const char *p, const char *end, int len){
+    if (len <= 0) return 0;
+    if (*p == '-') return -decodeSample(p+1, end, len-1);
+    if (len <= 8 && p + 8 <= end) return swarDigits(p, len);
+    return scalarSample(p, len);
+}
+
+// Parse n whitespace separated samples of a text image, starting at p, into the planes.
+// Sample k is stored in planes[(first+k)%3][(first+k)/3], i.e. samples are interleaved R, G, B,
+// saturated to [0, maxcolor] with the given bytes per sample.
+// 16 bytes are classified at once with SSE2 (digits and '-' vs. separators) and every token fully
+// inside the window is decoded without rescanning it. Returns the position after the last sample.
+const char *parseTextSamples(const char *p, const char *end, void **planes, int bytes, int maxcolor, long first, long n){
+    long k = 0, px = first / 3;
+    int ch = first % 3;
+    int len = 0;
+    
+#define STORE_SAMPLE(value) do { int v_ = (value); SET_SAMPLE(planes[ch], px, bytes, SATURATE(v_, maxcolor)); \
+                                 if (++ch == 3) { ch = 0; px++; } k++; } while (0)
+#ifdef __SSE2__
+    const __m128i lo = _mm_set1_epi8('0'-1), hi = _mm_set1_epi8('9'+1), minus = _mm_set1_epi8('-');
+    while (k < n && p + 16 <= end) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(digit, _mm_cmpeq_epi8(v, minus)));
+        int s = 0;
+        while (mask && k < n) {
+            s = __builtin_ctz(mask);
+            len = __builtin_ctz(~(mask >> s));
+            if (s + len >= 16) break;               // token may continue after the window
+            STORE_SAMPLE(decodeSample(p + s, end, len));
+            mask &= ~(((1u << len) - 1) << s);
+        }
+        if (k == n) { p += s + len; break; }
+        if (mask == 0) p += 16;
+        else if (s > 0) p += s;                     // reload the window at the token start
+        else {                                      // token of 16 or more characters
+            for (len = 16; p + len < end && ((p[len] >= '0' && p[len] <= '9') || p[len] == '-'); len++);
+            STORE_SAMPLE(scalarSample(p, len));
+            p += len;
+        }
+    }
+#endif
+    // Scalar tail
+    while (k < n) {
+        while (p < end && !((*p >= '0' && *p <= '9') || *p == '-')) p++;
+        if (p >= end) {
+            fprintf(stderr,"Error: unexpected end of the text image data\n");
+            return NULL;
+        }
+        for (len = 1; p + len < end && p[len] >= '0' && p[len] <= '9'; len++);
+        STORE_SAMPLE(decodeSample(p, end, len));
+        p += len;
+    }
+#undef STORE_SAMPLE
+    return p;
+}
+
+#define TEXT_RANGE_MIN (1<<20)                 // Smallest byte range worth a thread
+#define IS_TOKEN(c) (((c) >= '0' && (c) <= '9') || (c) == '-')
+
+// Split the mapped text in byte ranges for the parallel parser. Every range boundary is moved
+// forward to the end of the token it falls in, the samples of every range are counted in parallel
+// and the counts are prefix-summed, so the sample index where every range starts is known.
+int indexText(ImagenData img){
+    int r, n = omp_get_max_threads()*4;
+    long size = img->mapsize - img->body;
+    const char *map = img->map;
+    
+    if (size / TEXT_RANGE_MIN < n) n = size / TEXT_RANGE_MIN;
+    if (n <= 1) return 0;
+    img->rangeStart = malloc((n+1)*sizeof(long));
+    img->rangeSample = malloc((n+1)*sizeof(long));
+    if (img->rangeStart == NULL || img->rangeSample == NULL) return -1;
+    
+    for (r=0;r<n;r++) {
+        long b = img->body + size / n * r;
+        if (r > 0) while (b < (long)img->mapsize && IS_TOKEN(map[b-1]) && IS_TOKEN(map[b])) b++;
+        img->rangeStart[r] = b;
+    }
+    img->rangeStart[n] = img->mapsize;
+    
+    #pragma omp parallel for schedule(static)
+    for (r=0;r<n;r++) img->rangeSample[r+1] = countTokens(map + img->rangeStart[r], map + img->rangeStart[r+1]);
+    img->rangeSample[0] = 0;
+    for (r=0;r<n;r++) img->rangeSample[r+1] += img->rangeSample[r];
+    
+    img->nranges = n;
+    img->lastPosition = img->body;
+    img->lastSample = 0;
+    return 0;
+}
+
+// Number of samples starting in [p, end). p must not be in the middle of a sample.
+long countTokens(const char *p, const char *end){
+    long count = 0;
+    int prev = 0;
+    for (; p < end; p++) {
+        int tok = IS_TOKEN(*p);
+        count += tok & !prev;
+        prev = tok;
+    }
+    return count;
+}
+
+// Read the next dim pixels of a piped text image. The input is read in large blocks and only the
+// complete samples of a block are parsed; the incomplete one at its end waits for the next block.
+#define PIPE_BUFFER (1<<20)
+int readPipedText(ImagenData img, FILE **fp, int dim){
+    void *planes[3] = {img->R, img->G, img->B};
+    long k = 0, n = (long)dim*3;
+    
+    if (img->pipebuf == NULL && (img->pipebuf = malloc(PIPE_BUFFER)) == NULL) return -1;
+    while (k < n) {
+        char *p = img->pipebuf + img->pipepos, *end = img->pipebuf + img->pipelen, *safe = end;
+        long avail;
+        size_t r;
+        
+        if (!img->pipeeof) while (safe > p && IS_TOKEN(safe[-1])) safe--;
+        if ((avail = countTokens(p, safe)) > 0) {
+            avail = MIN(avail, n - k);
+            p = (char *)parseTextSamples(p, safe, planes, sampleBytes(img), img->maxcolor, k, avail);
+            img->pipepos = p - img->pipebuf;
+            k += avail;
+            continue;
+        }
+        if (img->pipeeof) {
+            fprintf(stderr,"Error: unexpected end of the text image data\n");
+            return -1;
+        }
+        // Keep the incomplete sample and fill the rest of the buffer
+        memmove(img->pipebuf, p, end - p);
+        img->pipelen = end - p;
+        img->pipepos = 0;
+        if (img->pipelen == PIPE_BUFFER) return -1;
+        r = fread(img->pipebuf + img->pipelen, 1, PIPE_BUFFER - img->pipelen, *fp);
+        if (r == 0) img->pipeeof = 1;
+        img->pipelen += r;
+    }
+    return 0;
+}
+
+// Read dim pixels starting at the file offset *position using the range index: every range holding
+// part of the chunk is parsed by its own thread. *position is updated to the first halo pixel.
+int readTextChunk(ImagenData img, int dim, int haloposition, long *position){
+    long s0, send, shalo, *rs = img->rangeStart, *rn = img->rangeSample;
+    int r, first, last, error = 0, bytes = sampleBytes(img);
+    const char *end = img->map + img->mapsize, *halo = NULL;
+    void *planes[3] = {img->R, img->G, img->B};
+    
+    // Sample index at the requested position. Positions are the ones returned before.
+    if (*position == img->lastPosition) s0 = img->lastSample;
+    else if (*position == img->body) s0 = 0;
+    else {
+        fprintf(stderr,"Error: unknown position %ld in the text image\n", *position);
+        return -1;
+    }
+    send  = s0 + (long)dim*3;
+    shalo = s0 + (long)haloposition*3;
+    for (first=0; first < img->nranges-1 && rn[first+1] <= s0; first++);
+    for (last=first; last < img->nranges-1 && rn[last+1] < send; last++);
+    
+    #pragma omp parallel for schedule(dynamic) reduction(|:error)
+    for (r=first;r<=last;r++) {
+        long a = MAX(rn[r], s0), b = MIN(rn[r+1], send);
+        const char *p = (r == first) ? img->map + *position : img->map + rs[r];
+        if (a >= b) continue;
+        // The range holding the first halo sample also reports its offset.
+        if (shalo > a && shalo < b) {
+            if ((p = parseTextSamples(p, end, planes, bytes, img->maxcolor, a - s0, shalo - a)) == NULL) { error = 1; continue; }
+            halo = p;
+            a = shalo;
+        }
+        else if (shalo == a) halo = p;
+        if ((p = parseTextSamples(p, end, planes, bytes, img->maxcolor, a - s0, b - a)) == NULL) error = 1;
+        // Without halo the next chunk starts after the last sample
+        else if (shalo == send && b == send) halo = p;
+    }
+    if (error) return -1;
+    *position = halo - img->map;
+    img->lastPosition = *position;
+    img->lastSample = shalo;
+    return 0;
+}
+
+// Sidecar cache file name for an image
+static void cacheName(char *nombre, char *name){
+    snprintf(name, PATH_MAX_CACHE, "%s.cache", nombre);
+}
+
+// Map the sidecar cache of the image if it exists and matches the current source (path, size and mtime).
+int openCache(ImagenData img, char *nombre, struct stat *st){
+    char name[PATH_MAX_CACHE];
+    struct cacheheader *h;
+    struct stat cst;
+    size_t size = sizeof(struct cacheheader) + (size_t)img->ancho*img->altura*3*sampleBytes(img);
+    void *m;
+    int fd;
+    
+    cacheName(nombre, name);
+    if ((fd = open(name, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &cst) != 0 || (size_t)cst.st_size != size) { close(fd); return -1; }
+    m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    h = m;
+    if (memcmp(h->magic, CACHE_MAGIC, 8) != 0 || h->srcsize != st->st_size ||
+        h->mtime != st->st_mtim.tv_sec || h->mtimensec != st->st_mtim.tv_nsec ||
+        strncmp(h->source, nombre, PATH_MAX_CACHE) != 0 ||
+        h->ancho != img->ancho || h->altura != img->altura || h->maxcolor != img->maxcolor ||
+        h->bytes != sampleBytes(img)) {
+        munmap(m, size);
+        return -1;
+    }
+    if (img->map != NULL) munmap(img->map, img->mapsize);
+    img->map = NULL;
+    img->cache = m;
+    img->cachesize = size;
+    return 0;
+}
+
+// Write the sidecar cache of a mapped text image. Every range of the text index is parsed by its own
+// thread straight into the planes of the new file, which is renamed into place once complete.
+int buildCache(ImagenData img, char *nombre, struct stat *st){
+    char name[PATH_MAX_CACHE], tmp[PATH_MAX_CACHE+8];
+    long total = (long)img->ancho*img->altura*3;
+    long start0 = img->body, sample0 = 0, end0 = total;
+    long *rs = img->nranges > 1 ? img->rangeStart : &start0;
+    long *rn = img->nranges > 1 ? img->rangeSample : &sample0;
+    int r, nranges = img->nranges > 1 ? img->nranges : 1, bytes = sampleBytes(img), error = 0;
+    size_t size = sizeof(struct cacheheader) + (size_t)total*bytes;
+    struct cacheheader *h;
+    unsigned char *m;
+    int fd;
+    
+    cacheName(nombre, name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    if ((fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0) return -1;
+    if (ftruncate(fd, size) != 0 ||
+        (m = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    
+    #pragma omp parallel for schedule(dynamic) reduction(|:error)
+    for (r=0;r<nranges;r++) {
+        long a = rn[r], b = MIN((nranges > 1 ? rn[r+1] : end0), total);
+        const char *p = img->map + rs[r], *end = img->map + img->mapsize;
+        void *planes[3];
+        int k;
+        for (k=0;k<3;k++) planes[k] = m + sizeof(struct cacheheader) + (size_t)k*(total/3)*bytes;
+        if (a < b && parseTextSamples(p, end, planes, bytes, img->maxcolor, a, b - a) == NULL) error = 1;
+    }
+    
+    h = (struct cacheheader *)m;
+    memset(h, 0, sizeof(struct cacheheader));
+    memcpy(h->magic, CACHE_MAGIC, 8);
+    h->srcsize = st->st_size;
+    h->mtime = st->st_mtim.tv_sec;
+    h->mtimensec = st->st_mtim.tv_nsec;
+    h->ancho = img->ancho;
+    h->altura = img->altura;
+    h->maxcolor = img->maxcolor;
+    h->bytes = bytes;
+    strncpy(h->source, nombre, PATH_MAX_CACHE-1);
+    strncpy(h->comentario, img->comentario, 299);
+    munmap(m, size);
+    if (error || rename(tmp, name) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy dim pixels starting at pixel *position from the cache planes.
+int readCachedChunk(ImagenData img, int dim, int haloposition, long *position){
+    long npix = (long)img->ancho*img->altura, first = *position;
+    unsigned char *planes = img->cache + sizeof(struct cacheheader);
+    int bytes = sampleBytes(img);
+    
+    // The cache planes already hold narrow samples of the same size
+    if (first + dim > npix) dim = npix - first;
+    memcpy(img->R, PLANE_AT(planes, first, bytes), (size_t)dim*bytes);
+    memcpy(img->G, PLANE_AT(planes, npix+first, bytes), (size_t)dim*bytes);
+    memcpy(img->B, PLANE_AT(planes, 2*npix+first, bytes), (size_t)dim*bytes);
+    *position = first + haloposition;
+    return 0;
+}
+
 //Duplication of the  just readed source chunk to the destiny image struct chunk
 int duplicateImageChunk(ImagenData src, ImagenData dst, int dim){
-    int i=0;
+    int bytes = sampleBytes(src);
     
-    for(i=0;i<dim;i++){
-        dst->R[i] = src->R[i];
-        dst->G[i] = src->G[i];
-        dst->B[i] = src->B[i];
-    }
+    memcpy(dst->R, src->R, (size_t)dim*bytes);
+    memcpy(dst->G, src->G, (size_t)dim*bytes);
+    memcpy(dst->B, src->B, (size_t)dim*bytes);
 //    printf ("Duplicated = %d pixels\n",i);
     return 0;
 }
 
 // Open kernel file and reading kernel matrix. The kernel matrix 2D is stored in 1D format.
+// A comma separated list of kernel files is a chain, see leerChain.
 kernelData leerKernel(char* nombre){
     FILE *fp;
     int i=0;
     kernelData kern=NULL;
     
+    if (strchr(nombre, ',') != NULL) return leerChain(nombre);
     /*Opening the kernel file*/
     fp=fopen(nombre,"r");
     if(!fp){
@@ -160,6 +762,8 @@ kernelData leerKernel(char* nombre){
     else{
         //Memory allocation
         kern=(kernelData) malloc(sizeof(struct structkernel));
+        kern->nstages = 0;
+        kern->stages = NULL;
         
         //Reading kernel matrix dimensions
         fscanf(fp,"%d,%d,", &kern->kernelX, &kern->kernelY);
@@ -171,40 +775,390 @@ kernelData leerKernel(char* nombre){
         }
         fscanf(fp,"%f",&kern->vkern[i]);
         fclose(fp);
+        if (factorKernel(kern) || compileTaps(kern) || integerTaps(kern)) {
+            free(kern->vkern);
+            free(kern);
+            return NULL;
+        }
+        findSymmetry(kern);
+        findBlur(kern);
+    }
+    return kern;
+}
+
+// Read a chain of kernels, "k1,k2,...", applied in that order. As convolution is associative the
+// chain is the kernel composed of all of them, which is analysed and planned as any other kernel;
+// the stages are also kept so the planner can apply them one after the other (METHOD_FUSED).
+kernelData leerChain(char* nombre){
+    char *list = strdup(nombre), *name, *save = NULL;
+    kernelData kern = NULL, *stages = NULL;
+    int n = 0, i, count = 1;
+    
+    for (i=0;nombre[i];i++) if (nombre[i] == ',') count++;
+    if (list == NULL || (stages = calloc(count, sizeof(kernelData))) == NULL) { free(list); return NULL; }
+    for (name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+        if ((stages[n++] = leerKernel(name)) == NULL) break;
+    if (n > 0 && stages[n-1] != NULL && (kern = calloc(1, sizeof(struct structkernel))) != NULL) {
+        if (chainKernels(kern, stages, n) || factorKernel(kern) || compileTaps(kern) || integerTaps(kern)) {
+            free(kern->vkern);
+            free(kern);
+            kern = NULL;
+        }
+        else {
+            findSymmetry(kern);
+            findBlur(kern);
+        }
+    }
+    if (kern == NULL) {
+        for (i=0;i<n;i++)
+            if (stages[i] != NULL) { free(stages[i]->vkern); free(stages[i]); }
+        free(stages);
     }
+    free(list);
     return kern;
 }
 
+// Compose the nstages kernels of a chain in kern, which keeps the stages. Every stage K, with the
+// center (kCY,kCX) = (kY/2,kX/2), adds K[m][n]*x[i+kCY-m][j+kCX-n], so two stages compose into
+// C[m1+m2][n1+n2] += K1[m1][n1]*K2[m2][n2] around the center (kCY1+kCY2,kCX1+kCX2). Two even sizes
+// get a last row or column of zeros, so that center is still the one of the composed size.
+int chainKernels(kernelData kern, kernelData *stages, int nstages){
+    int s, m, n, p, q, kX = stages[0]->kernelX, kY = stages[0]->kernelY;
+    float *taps = malloc(kX*kY*sizeof(float)), *next;
+    
+    if (taps == NULL) return -1;
+    memcpy(taps, stages[0]->vkern, kX*kY*sizeof(float));
+    for (s=1;s<nstages;s++) {
+        int sX = stages[s]->kernelX, sY = stages[s]->kernelY;
+        int nX = MAX(kX + sX - 1, 2*(kX/2 + sX/2)), nY = MAX(kY + sY - 1, 2*(kY/2 + sY/2));
+        const float *k = stages[s]->vkern;
+        if ((next = calloc(nX*nY, sizeof(float))) == NULL) { free(taps); return -1; }
+        for (m=0;m<kY;m++)
+            for (n=0;n<kX;n++)
+                for (p=0;p<sY;p++)
+                    for (q=0;q<sX;q++) next[(m+p)*nX + n+q] += taps[m*kX+n] * k[p*sX+q];
+        free(taps);
+        taps = next;
+        kX = nX;
+        kY = nY;
+    }
+    kern->kernelX = kX;
+    kern->kernelY = kY;
+    kern->vkern = taps;
+    kern->nstages = nstages;
+    kern->stages = stages;
+    return 0;
+}
+
+// Check if the kernel has rank 1 and factor it in a column and a row vector, so it can be applied in two
+// 1D passes. A rank revealing step of LU with complete pivoting: with the largest tap K[p][q] as pivot,
+// col[m] = K[m][q] and row[n] = K[p][n]/K[p][q]. The kernel is separable when no tap differs from
+// col[m]*row[n] more than SEPARABLE_TOLERANCE relative to the pivot.
+#define SEPARABLE_TOLERANCE 1e-4f
+int factorKernel(kernelData kern){
+    int m, n, p = 0, q = 0, kX = kern->kernelX, kY = kern->kernelY;
+    float *k = kern->vkern, pivot = 0, error = 0;
+    
+    kern->separable = 0;
+    kern->vcol = kern->vrow = NULL;
+    kern->fftsize = 0;
+    kern->spectrum = kern->twiddle = NULL;
+    kern->bitrev = NULL;
+    kern->method = METHOD_DIRECT;
+    for (m=0;m<kY;m++)
+        for (n=0;n<kX;n++)
+            if (fabsf(k[m*kX+n]) > fabsf(pivot)) { pivot = k[m*kX+n]; p = m; q = n; }
+    // A single row or column is already a 1D pass, and a null kernel has nothing to factor
+    if (pivot == 0 || kX == 1 || kY == 1) return 0;
+    
+    if ((kern->vcol = malloc(kY*sizeof(float))) == NULL || (kern->vrow = malloc(kX*sizeof(float))) == NULL) return -1;
+    for (m=0;m<kY;m++) kern->vcol[m] = k[m*kX+q];
+    for (n=0;n<kX;n++) kern->vrow[n] = k[p*kX+n] / pivot;
+    for (m=0;m<kY;m++)
+        for (n=0;n<kX;n++)
+            error = MAX(error, fabsf(k[m*kX+n] - kern->vcol[m]*kern->vrow[n]));
+    if (error <= SEPARABLE_TOLERANCE * fabsf(pivot)) kern->separable = 1;
+    else {
+        free(kern->vcol);
+        free(kern->vrow);
+        kern->vcol = kern->vrow = NULL;
+    }
+    return 0;
+}
+
+// List the nonzero taps of the kernel, in the order convolve2D adds them, so a sparse kernel can be
+// applied skipping its zeros. Adding a zero product does not change a sum, so the result is the same.
+// The list is only kept when at most SPARSE_DENSITY of the taps are nonzero.
+#define SPARSE_DENSITY 0.75f
+int compileTaps(kernelData kern){
+    int m, n, i = 0, kX = kern->kernelX, kY = kern->kernelY, nonzero = 0;
+    
+    kern->ntaps = 0;
+    kern->tapPos = NULL;
+    kern->tapWeight = NULL;
+    for (m=0;m<kX*kY;m++) if (kern->vkern[m] != 0) nonzero++;
+    if (nonzero > SPARSE_DENSITY * kX*kY) return 0;
+    
+    if ((kern->tapPos = malloc(2*(nonzero+1)*sizeof(int))) == NULL ||
+        (kern->tapWeight = malloc((nonzero+1)*sizeof(float))) == NULL) return -1;
+    for (m=0;m<kY;m++)
+        for (n=0;n<kX;n++)
+            if (kern->vkern[m*kX+n] != 0) {
+                kern->tapPos[2*i] = m;
+                kern->tapPos[2*i+1] = n;
+                kern->tapWeight[i++] = kern->vkern[m*kX+n];
+            }
+    kern->ntaps = nonzero;
+    return 0;
+}
+
+// Sign s of the symmetry K[m][n] == s*K[m'][n'], where (m',n') is (m,n) mirrored left-right (flipX),
+// top-bottom (flipY) or both, or 0 if there is none. The taps must be exactly equal.
+static int kernelSymmetry(const float *k, int kX, int kY, int flipX, int flipY){
+    int m, n, s;
+    for (s=1;s>=-1;s-=2) {
+        int match = 1;
+        for (m=0;m<kY && match;m++)
+            for (n=0;n<kX && match;n++)
+                match = k[m*kX+n] == s*k[(flipY ? kY-1-m : m)*kX + (flipX ? kX-1-n : n)];
+        if (match) return s;
+    }
+    return 0;
+}
+
+// Find the symmetries of the kernel, so the taps of the same weight can share a multiply
+void findSymmetry(kernelData kern){
+    kern->hsym = kernelSymmetry(kern->vkern, kern->kernelX, kern->kernelY, 1, 0);
+    kern->vsym = kernelSymmetry(kern->vkern, kern->kernelX, kern->kernelY, 0, 1);
+    kern->psym = kernelSymmetry(kern->vkern, kern->kernelX, kern->kernelY, 1, 1);
+}
+
+// Pack the taps of an integral kernel in pairs of shorts for the integer engines (see intRowEngine),
+// and sum their absolute values, of the kernel and of its largest row, to bound the sums. A kernel
+// with a fraction or a tap out of the shorts is not integral, pairs is NULL.
+#define INTEGER_TAP_MAX 32767           // largest tap and sample of the 16-bit multiply-adds
+#define INTEGER_SUM_MAX 2147483647LL    // largest sum of an int32
+int integerTaps(kernelData kern){
+    int m, n, kX = kern->kernelX, kY = kern->kernelY, np = (kX + 1) / 2;
+    const float *k = kern->vkern;
+    
+    kern->pairs = NULL;
+    kern->tapSum = kern->rowSum = 0;
+    for (m=0;m<kX*kY;m++) if (k[m] != rintf(k[m]) || fabsf(k[m]) > INTEGER_TAP_MAX) return 0;
+    
+    if ((kern->pairs = calloc(kY*np, sizeof(int))) == NULL) return -1;
+    for (m=0;m<kY;m++) {
+        long long row = 0;
+        for (n=0;n<kX;n++) {
+            int tap = (int)k[m*kX+n];
+            kern->pairs[m*np + n/2] |= (int)((unsigned)(tap & 0xffff) << 16*(n%2));
+            row += abs(tap);
+        }
+        kern->tapSum += row;
+        kern->rowSum = MAX(kern->rowSum, row);
+    }
+    return 0;
+}
+
+// The integer method needs the samples in shorts, and the sums of a kernel row at least in an int32
+// (those of the whole kernel are added in int64 otherwise)
+int integerPossible(kernelData kern, int maxcolor){
+    return kern->pairs != NULL && maxcolor <= INTEGER_TAP_MAX && kern->rowSum * maxcolor <= INTEGER_SUM_MAX;
+}
+
 // Open the image file with the convolution results
 int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position){
     /*Se crea el fichero con la imagen resultante*/
-    if ( (*fp=fopen(nombre,"w")) == NULL ){
+    if (strcmp(nombre,"-") == 0) *fp = stdout;
+    else *fp = fopen(nombre,"w");
+    if ( *fp == NULL ){
         perror("Error: ");
         return -1;
     }
     /*Writing Image Header*/
-    fprintf(*fp,"P%d\n%s\n%d %d\n%d\n",img->P,img->comentario,img->ancho,img->altura,img->maxcolor);
+    fprintf(*fp,"P%d\n",img->P);
+    if (img->comentario[0]) fprintf(*fp,"%s\n",img->comentario);
+    fprintf(*fp,"%d %d\n%d\n",img->ancho,img->altura,img->maxcolor);
     *position = ftell(*fp);
+    img->stored = 0;
+    img->positional = 0;
+    // The size of a binary result is known: allocate the whole file so rows can be written anywhere.
+    if (img->P == 6) {
+        struct stat st;
+        off_t size = *position + (off_t)img->ancho*img->altura*3*sampleBytes(img);
+        fflush(*fp);
+        if (fstat(fileno(*fp), &st) == 0 && S_ISREG(st.st_mode) &&
+            (posix_fallocate(fileno(*fp), 0, size) == 0 || ftruncate(fileno(*fp), size) == 0)) {
+            img->body = *position;
+            img->positional = 1;
+        }
+    }
     return 0;
 }
 
 // Writing the image partition to the resulting file. dim is the exact size to write. offset is the displacement for avoid halos.
+// The text is the same fprintf("%d %d %d ") gave for every pixel, but blocks of pixels are formatted
+// in parallel in per-thread buffers and every round of blocks is written in order with one writev.
+#define SAVING_BLOCK 65536                          // pixels formatted by a thread at once
+#define PIXEL_TEXT_MAX 36                           // "-2147483648 " three times
 int savingChunk(ImagenData img, FILE **fp, int dim, int offset){
-    int i,k=0;
+    int i, t, nblocks, nthreads = omp_get_max_threads(), error = 0;
+    char **bufs;
+    struct iovec *iov;
+    
+    if (img->P == 6) return savingBinaryChunk(img, fp, dim, offset);
+    if (dim <= 0) return 0;
+    nblocks = (dim + SAVING_BLOCK - 1) / SAVING_BLOCK;
+    if (nthreads > nblocks) nthreads = nblocks;
+    bufs = calloc(nthreads, sizeof(char *));
+    iov = malloc(nthreads*sizeof(struct iovec));
+    if (bufs == NULL || iov == NULL) error = -1;
+    for (t=0;t<nthreads && !error;t++)
+        if ((bufs[t] = malloc((size_t)SAVING_BLOCK*PIXEL_TEXT_MAX)) == NULL) error = -1;
+    //The header was written through the stream
+    fflush(*fp);
     //Writing image partition
-    for(i=offset;i<dim+offset;i++){
-        fprintf(*fp,"%d %d %d ",img->R[i],img->G[i],img->B[i]);
-//        if ((i+1)%6==0) fprintf(*fp,"\n");
-        k++;
+    for (i=0; i<nblocks && !error; i+=nthreads) {
+        int n = MIN(nthreads, nblocks-i);
+        #pragma omp parallel for schedule(static) num_threads(n)
+        for (t=0;t<n;t++) {
+            int from = offset + (i+t)*SAVING_BLOCK, to = MIN(from + SAVING_BLOCK, offset + dim);
+            iov[t].iov_base = bufs[t];
+            iov[t].iov_len  = formatPixels(bufs[t], img, from, to) - bufs[t];
+        }
+        error = writeAll(fileno(*fp), iov, n);
+    }
+    for (t=0;t<nthreads && bufs != NULL;t++) free(bufs[t]);
+    free(bufs);
+    free(iov);
+    return error;
+}
+
+// Two digits of every number from 0 to 99
+static const char digitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Format v in decimal at p, followed by a space. Digits are produced by pairs from the end.
+static inline char *formatSample(char *p, int v){
+    char tmp[12], *t = tmp + sizeof(tmp);
+    unsigned u = (v < 0) ? -(unsigned)v : (unsigned)v;
+    int len;
+    
+    if (v >= 0 && v < 10) { p[0] = '0' + v; p[1] = ' '; return p + 2; }
+    while (u >= 100) {
+        unsigned q = u / 100;
+        t -= 2;
+        memcpy(t, digitPairs + 2*(u - q*100), 2);
+        u = q;
+    }
+    if (u >= 10) { t -= 2; memcpy(t, digitPairs + 2*u, 2); }
+    else *--t = '0' + u;
+    if (v < 0) *--t = '-';
+    len = tmp + sizeof(tmp) - t;
+    memcpy(p, t, len);
+    p[len] = ' ';
+    return p + len + 1;
+}
+
+// Format the pixels [from, to) of the planes at p. Returns the end of the text.
+char *formatPixels(char *p, ImagenData img, int from, int to){
+    int i, bytes = sampleBytes(img);
+    for (i=from;i<to;i++) {
+        p = formatSample(p, GET_SAMPLE(img->R, i, bytes));
+        p = formatSample(p, GET_SAMPLE(img->G, i, bytes));
+        p = formatSample(p, GET_SAMPLE(img->B, i, bytes));
+    }
+    return p;
+}
+
+// writev the buffers completely, retrying after partial writes.
+int writeAll(int fd, struct iovec *iov, int n){
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) { w -= iov->iov_len; iov++; n--; }
+        if (n > 0) { iov->iov_base = (char *)iov->iov_base + w; iov->iov_len -= w; }
+    }
+    return 0;
+}
+
+// Binary version of savingChunk.
+// In a preallocated file every thread encodes blocks of rows and writes them at their final offset.
+int savingBinaryChunk(ImagenData img, FILE **fp, int dim, int offset){
+    int n, done=0, bytes=sampleBytes(img), error=0;
+    int block = img->ancho*64;                      // pixels encoded per write
+    unsigned char *buf;
+    
+    if (block > dim) block = dim;
+    if (block <= 0) return 0;
+    if (img->positional) {
+        int nblocks = (dim + block - 1) / block;
+        #pragma omp parallel reduction(|:error)
+        {
+            unsigned char *tbuf = malloc((size_t)block*3*bytes);
+            int t;
+            if (tbuf == NULL) error = 1;
+            else {
+                #pragma omp for schedule(dynamic)
+                for (t=0;t<nblocks;t++) {
+                    int from = offset + t*block, to = MIN(from + block, offset + dim);
+                    size_t len = encodePixels(tbuf, img, from, to) - tbuf, w = 0;
+                    off_t at = img->body + (off_t)(img->stored + from - offset)*3*bytes;
+                    while (w < len) {
+                        ssize_t r = pwrite(fileno(*fp), tbuf + w, len - w, at + w);
+                        if (r < 0 && errno == EINTR) continue;
+                        if (r <= 0) { error = 1; break; }
+                        w += r;
+                    }
+                }
+                free(tbuf);
+            }
+        }
+        img->stored += dim;
+        return error ? -1 : 0;
+    }
+    if ((buf=malloc((size_t)block*3*bytes)) == NULL) return -1;
+    while (done < dim) {
+        n = MIN(block, dim-done);
+        encodePixels(buf, img, offset+done, offset+done+n);
+        if (fwrite(buf, 3*bytes, n, *fp) != (size_t)n) {
+            free(buf);
+            return -1;
+        }
+        done += n;
     }
-//    printf ("Writed = %d pixels, dim=%d, offset=%d\n",k,dim, offset);
+    img->stored += dim;
+    free(buf);
     return 0;
 }
 
+// Encode the pixels [from, to) of the planes as P6 samples at b. Returns the end of the data.
+unsigned char *encodePixels(unsigned char *b, ImagenData img, int from, int to){
+    int i, j, v[3], bytes = sampleBytes(img);
+    for(i=from;i<to;i++) {
+        v[0] = GET_SAMPLE(img->R, i, bytes); v[1] = GET_SAMPLE(img->G, i, bytes); v[2] = GET_SAMPLE(img->B, i, bytes);
+        for(j=0;j<3;j++) {
+            if (bytes == 2) *b++ = v[j]>>8;
+            *b++ = v[j]&0xff;
+        }
+    }
+    return b;
+}
+
 // This function free the space allocated for the image structure.
 void freeImagestructure(ImagenData *src){
     
     free((*src)->comentario);
+    if ((*src)->map != NULL) munmap((*src)->map, (*src)->mapsize);
+    if ((*src)->cache != NULL) munmap((*src)->cache, (*src)->cachesize);
+    free((*src)->pipebuf);
+    free((*src)->rangeStart);
+    free((*src)->rangeSample);
     free((*src)->R);
     free((*src)->G);
     free((*src)->B);
@@ -222,178 +1176,2436 @@ void freeImagestructure(ImagenData *src){
 // pointer indexing in order to minimize the number of multiplications.
 //
 //
-// signed integer (32bit) version:
+// Narrow samples version: the planes hold uint8 or uint16 samples and every
+// result is rounded and saturated to [0, maxcolor]. The body is specialized for
+// every sample size by inlining it with a constant bytes.
+// The R, G and B planes are convolved in the same pass: in[3] and out[3]. Every
+// kernel tap is loaded once and applied to the three channels, each of them
+// accumulated in the same order as a single channel pass.
+// The planes are first converted to float in buffers with a zero ghost border,
+// so every tap falls inside them and all the pixels run the same fixed trip count
+// loops with no bound checks. Adding the zero taps does not change any sum, so
+// the result is the same as the implicit zero padding of the borders.
+// The rows are computed by a SIMD engine, vectorized across output columns with
+// the kernel taps broadcast. The taps keep the scalar order and the products are
+// not fused, so every engine gives exactly the same sums.
 ///////////////////////////////////////////////////////////////////////////////
-int convolve2D(int* in, int* out, int dataSizeX, int dataSizeY,
-               float* kernel, int kernelSizeX, int kernelSizeY)
-{
-    int i, j;
-    int *inPtr, *inPtr2, *outPtr;
-    float *kPtr;
-    int kCenterX, kCenterY;
-    //int rowMin, rowMax;                             // to check boundary of input array
-    //float sum;                                      // temp accumulation buffer
-    
-    // check validity of params
-    if(!in || !out || !kernel) return -1;
-    if(dataSizeX <= 0 || kernelSizeX <= 0) return -1;
-    
-    // find center position of kernel (half of kernel size)
-    kCenterX = (int)kernelSizeX / 2;
-    kCenterY = (int)kernelSizeY / 2;
-    
-    // init working  pointers
-    inPtr = inPtr2 = &in[dataSizeX * kCenterY + kCenterX];  // note that  it is shifted (kCenterX, kCenterY),
-    outPtr = out;
-    kPtr = kernel;
+
+// Round a convolution sum to the nearest sample, saturated to [0, maxcolor]
+static inline int saturateSum(float sum, int maxcolor){
+    if (sum <= 0) return 0;
+    if (sum >= maxcolor) return maxcolor;
+    return (int)(sum + 0.5f);
+}
+
+// Copy the three dataSizeX x dataSizeY planes as floats in a zeroed buffer with padX columns on the
+// left and the right and padY rows on the top and the bottom. Returns the buffer, holding the three
+// padded planes one after the other, or NULL.
+static float *padPlanes(void** in, int dataSizeX, int dataSizeY, int padX, int padY, int bytes){
+    size_t stride = (size_t)dataSizeX + 2*padX, plane = stride * ((size_t)dataSizeY + 2*padY);
+    float *padded = calloc(3*plane, sizeof(float));
+    int ch, i, j;
     
-    // start convolution
-	// paralel private i
-    #pragma omp parallel for firstprivate(j, inPtr, kPtr, outPtr, kCenterX, kCenterY, dataSizeX, dataSizeY, kernelSizeX, kernelSizeY) schedule(dynamic)
-    for(i= 0; i < dataSizeY; ++i)                   // number of rows
-    {
-        // compute the range of convolution, the current row of kernel should be between these
-        int rowMax = MIN(i + kCenterY, kernelSizeY - 1);
-        int rowMin = MAX(i - dataSizeY + kCenterY + 1, 0);
-        // paralel private j, rowMax, rowMin
+    if (padded == NULL) return NULL;
+    for (ch=0;ch<3;ch++) {
+        #pragma omp parallel for private(j) schedule(static)
+        for (i=0;i<dataSizeY;i++) {
+            float *row = padded + ch*plane + (i+padY)*stride + padX;
+            long first = (long)i*dataSizeX;
+            if (bytes == 1) for (j=0;j<dataSizeX;j++) row[j] = ((sample8 *)in[ch])[first+j];
+            else            for (j=0;j<dataSizeX;j++) row[j] = ((sample16 *)in[ch])[first+j];
+        }
+    }
+    return padded;
+}
 
-        //#pragma omp parallel for firstprivate(i, rowMax, rowMin, inPtr, kPtr, outPtr) 
-        for(j = 0; j < dataSizeX; ++j)              // number of columns
-        {
-            // compute the range of convolution, the current column of kernel should be between these
-            int colMax = MIN(j + kCenterX, kernelSizeX - 1);
-            int colMin = MAX(j - dataSizeX + kCenterX + 1, 0);
-
-            inPtr = inPtr2 + (i*dataSizeX) + j;
-           
-            float sum = 0;                                // set to 0 before accumulate
-            int n, m;
-            
-            // flip the kernel and traverse all the kernel values
-            // multiply each kernel value with underlying input data
-            for(m = rowMin; m <= rowMax; ++m)        // kernel rows
-            {
-                int *inPtrAux = inPtr - m * dataSizeX;
-                // check if the index is out of bound of input array
-                //if(m <= rowMax && m > rowMin)
-                //{
-                for(n = colMin; n <= colMax; ++n)
-                {
-                    kPtr = kernel + m * kernelSizeX + n;
-                    //inPtr = inPtr - m * dataSizeX;
-                    // check the boundary of array
-                    //if(n <= colMax && n > colMin)
-                    sum += *(inPtrAux - n) * *kPtr; //paralel atomic
-                    
-                    //++kPtr;                     // next kernel
-                }
-                //}
-                //else
-                //    kPtr += kernelSizeX;            // out of bound, move to next row of kernel
-                
-                //inPtr -= dataSizeX;                 // move input data 1 raw up
+// Convolution sums of the columns [from, n) of one output row of the three channels. in is the
+// padded input under the kernel tap (0,0) of the column 0 in the R plane, the G and B planes are
+// plane floats after it. The sums are stored in sums[ch*sumsPlane + j].
+static int sumRowScalar(const float *in, long plane, long stride, int from, int n,
+                        const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane){
+    int j, m, t;
+    for (j=from;j<n;j++) {
+        float sumR = 0, sumG = 0, sumB = 0;
+        for (m=0;m<kernelSizeY;m++) {
+            const float *row = in + j - m*stride, *kPtr = kernel + m*kernelSizeX;
+            for (t=0;t<kernelSizeX;t++) {
+                float k = kPtr[t];
+                sumR += row[-t] * k;
+                sumG += row[plane-t] * k;
+                sumB += row[2*plane-t] * k;
             }
-			//paralel barrier
-            //#pragma omp barrier
-            // convert integer number
-            outPtr = out + (i*dataSizeX) + j;
-            if(sum >= 0) *outPtr = (int)(sum + 0.5f);
-//            else *outPtr = (int)(sum - 0.5f)*(-1);
-            // For using with image editors like GIMP or others...
-            else *outPtr = (int)(sum - 0.5f);
-            // For using with a text editor that read ppm images like libreoffice or others...
-//            else *outPtr = 0;
-            
-            kPtr = kernel;                          // reset kernel to (0,0)
-            //inPtr = ++inPtr2;                       // next input
-            //++outPtr;                               // next output
         }
+        sums[j] = sumR;
+        sums[sumsPlane+j] = sumG;
+        sums[2*sumsPlane+j] = sumB;
     }
-    
-    return 0;
+    return n;
 }
 
+// SIMD engines: same as sumRowScalar from the column 0. They return the first column not done,
+// which is left to the scalar engine.
+typedef int (*sumRowEngine)(const float *in, long plane, long stride, int n,
+                            const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane);
 
-//////////////////////////////////////////////////////////////////////////////////////////////////
-// MAIN FUNCTION
-//////////////////////////////////////////////////////////////////////////////////////////////////
-int main(int argc, char **argv)
-{
-    int i=0,j=0,k=0;
-//    int headstored=0, imagestored=0, stored;
-    
-    if(argc != 5)
-    {
-        printf("Usage: %s <image-file> <kernel-file> <result-file> <partitions>\n", argv[0]);
-        
-        printf("\n\nError, Missing parameters:\n");
-        printf("format: ./serialconvolution image_file kernel_file result_file\n");
-        printf("- image_file : source image path (*.ppm)\n");
-        printf("- kernel_file: kernel path (text file with 1D kernel matrix)\n");
-        printf("- result_file: result image path (*.ppm)\n");
-        printf("- partitions : Image partitions\n\n");
-        return -1;
-    }
-    
-    //////////////////////////////////////////////////////////////////////////////////////////////////
-    // READING IMAGE HEADERS, KERNEL Matrix, DUPLICATE IMAGE DATA, OPEN RESULTING IMAGE FILE
-    //////////////////////////////////////////////////////////////////////////////////////////////////
-    int imagesize, partitions, partsize, chunksize, halo, halosize;
-    long position=0;
-    double start, tstart=0, tend=0, tread=0, tcopy=0, tconv=0, tstore=0, treadk=0;
-    struct timeval tim;
-    FILE *fpsrc=NULL,*fpdst=NULL;
-    ImagenData source=NULL, output=NULL;
+// Every engine is an inline body instantiated for any kernel size and for the common square sizes
+// 3x3, 5x5 and 7x7 as constants, so the taps of a kernel row are a straight line of code. The rows
+// are left as a loop: a whole 7x7 kernel unrolled needs more registers than there are.
+#define FIXED_SIZE_ENGINES(name, attr)                                                                \
+attr static int name(const float *in, long plane, long stride, int n,                                 \
+                     const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane){ \
+    return name##Taps(in, plane, stride, n, kernel, kernelSizeX, kernelSizeY, sums, sumsPlane);       \
+}                                                                                                     \
+attr static int name##3x3(const float *in, long plane, long stride, int n,                            \
+                          const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane){ \
+    (void)kernelSizeX; (void)kernelSizeY;                                                             \
+    return name##Taps(in, plane, stride, n, kernel, 3, 3, sums, sumsPlane);                           \
+}                                                                                                     \
+attr static int name##5x5(const float *in, long plane, long stride, int n,                            \
+                          const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane){ \
+    (void)kernelSizeX; (void)kernelSizeY;                                                             \
+    return name##Taps(in, plane, stride, n, kernel, 5, 5, sums, sumsPlane);                           \
+}                                                                                                     \
+attr static int name##7x7(const float *in, long plane, long stride, int n,                            \
+                          const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane){ \
+    (void)kernelSizeX; (void)kernelSizeY;                                                             \
+    return name##Taps(in, plane, stride, n, kernel, 7, 7, sums, sumsPlane);                           \
+}
 
-    // Store number of partitions
-    partitions = atoi(argv[4]);
-    ////////////////////////////////////////
-    //Reading kernel matrix
-    gettimeofday(&tim, NULL);
-    start = tim.tv_sec+(tim.tv_usec/1000000.0);
-    tstart = start;
-    kernelData kern=NULL;
-    if ( (kern = leerKernel(argv[2]))==NULL) {
-        //        free(source);
-        //        free(output);
-        return -1;
+#ifdef X86_ENGINES
+#define SUM_ROW_ENGINE(name, isa, W, vec, zero, load, store, set1, add, mul)                          \
+__attribute__((target(isa))) static inline __attribute__((always_inline))                             \
+int name##Taps(const float *in, long plane, long stride, int n,                                       \
+               const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane){   \
+    int j, m, t;                                                                                      \
+    for (j=0;j+W<=n;j+=W) {                                                                           \
+        vec sumR = zero(), sumG = zero(), sumB = zero();                                              \
+        for (m=0;m<kernelSizeY;m++) {                                                                 \
+            const float *row = in + j - m*stride, *kPtr = kernel + m*kernelSizeX;                     \
+            _Pragma("GCC unroll 7")                                                                   \
+            for (t=0;t<kernelSizeX;t++) {                                                             \
+                vec k = set1(kPtr[t]);                                                                \
+                sumR = add(sumR, mul(load(row - t), k));                                              \
+                sumG = add(sumG, mul(load(row + plane - t), k));                                      \
+                sumB = add(sumB, mul(load(row + 2*plane - t), k));                                    \
+            }                                                                                         \
+        }                                                                                             \
+        store(sums + j, sumR);                                                                        \
+        store(sums + sumsPlane + j, sumG);                                                            \
+        store(sums + 2*sumsPlane + j, sumB);                                                          \
+    }                                                                                                 \
+    return j;                                                                                         \
+}                                                                                                     \
+FIXED_SIZE_ENGINES(name, __attribute__((target(isa))))
+SUM_ROW_ENGINE(sumRowSSE42, "sse4.2", 4, __m128, _mm_setzero_ps, _mm_loadu_ps, _mm_storeu_ps,
+               _mm_set1_ps, _mm_add_ps, _mm_mul_ps)
+SUM_ROW_ENGINE(sumRowAVX2, "avx2", 8, __m256, _mm256_setzero_ps, _mm256_loadu_ps, _mm256_storeu_ps,
+               _mm256_set1_ps, _mm256_add_ps, _mm256_mul_ps)
+#undef SUM_ROW_ENGINE
+
+// AVX-512 has fused multiply-add, which is kept off so the sums are the same as the other engines.
+// The last columns of the row are done with masked loads and stores.
+__attribute__((target("avx512f"), optimize("fp-contract=off"))) static inline __attribute__((always_inline))
+int sumRowAVX512Taps(const float *in, long plane, long stride, int n,
+                     const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane){
+    int j, m, t;
+    for (j=0;j<n;j+=16) {
+        __mmask16 mask = (n - j >= 16) ? 0xffff : (__mmask16)((1u << (n - j)) - 1);
+        __m512 sumR = _mm512_setzero_ps(), sumG = _mm512_setzero_ps(), sumB = _mm512_setzero_ps();
+        for (m=0;m<kernelSizeY;m++) {
+            const float *row = in + j - m*stride, *kPtr = kernel + m*kernelSizeX;
+            #pragma GCC unroll 7
+            for (t=0;t<kernelSizeX;t++) {
+                __m512 k = _mm512_set1_ps(kPtr[t]);
+                sumR = _mm512_add_ps(sumR, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, row - t), k));
+                sumG = _mm512_add_ps(sumG, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, row + plane - t), k));
+                sumB = _mm512_add_ps(sumB, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, row + 2*plane - t), k));
+            }
+        }
+        _mm512_mask_storeu_ps(sums + j, mask, sumR);
+        _mm512_mask_storeu_ps(sums + sumsPlane + j, mask, sumG);
+        _mm512_mask_storeu_ps(sums + 2*sumsPlane + j, mask, sumB);
     }
-    //The matrix kernel define the halo size to use with the image. The halo is zero when the image is not partitioned.
-    if (partitions==1) halo=0;
-    else halo = (kern->kernelY/2)*2;
-    gettimeofday(&tim, NULL);
-    treadk = treadk + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+    return n;
+}
+FIXED_SIZE_ENGINES(sumRowAVX512, __attribute__((target("avx512f"), optimize("fp-contract=off"))))
 
-    ////////////////////////////////////////
-    //Reading Image Header. Image properties: Magical number, comment, size and color resolution.
-    gettimeofday(&tim, NULL);
-    start = tim.tv_sec+(tim.tv_usec/1000000.0);
-    //Memory allocation based on number of partitions and halo size.
-    if ( (source = initimage(argv[1], &fpsrc, partitions, halo)) == NULL) {
-        return -1;
+// Blocked engines for large kernels, where every output vector of the engines above reads kernelY
+// rows of the three planes, too many to stay in L1. The row is done in strips of BLOCKED_STRIP
+// columns: for every kernel row, one 1D convolution of its input row is added to the sums of the
+// strip, BLOCKED_TILE vectors of columns at once kept in registers. A strip of sums and the input
+// rows under it stay in L1 while the taps of a kernel row are applied. Every sum adds its taps in
+// the same order as the engines above, so the results are the same.
+#define BLOCKED_MIN_SIZE 8              // kernels at least this wide use the blocked engines
+#define BLOCKED_STRIP 512
+#define BLOCKED_TILE 4
+#define BLOCKED_ROW_ENGINE(name, isa, W, vec, zero, load, store, set1, add, mul)                      \
+__attribute__((target(isa))) static inline __attribute__((always_inline))                             \
+void name##Tile(const float *row, long plane, const float *kPtr, int kernelSizeX, int first, int cols, \
+                float *sums, long sumsPlane){                                                         \
+    vec sumR[BLOCKED_TILE], sumG[BLOCKED_TILE], sumB[BLOCKED_TILE];                                   \
+    int t, c;                                                                                         \
+    _Pragma("GCC unroll 4")                                                                           \
+    for (c=0;c<cols;c++) {                                                                            \
+        sumR[c] = first ? zero() : load(sums + c*W);                                                  \
+        sumG[c] = first ? zero() : load(sums + sumsPlane + c*W);                                      \
+        sumB[c] = first ? zero() : load(sums + 2*sumsPlane + c*W);                                    \
+    }                                                                                                 \
+    for (t=0;t<kernelSizeX;t++) {                                                                     \
+        vec k = set1(kPtr[t]);                                                                        \
+        _Pragma("GCC unroll 4")                                                                       \
+        for (c=0;c<cols;c++) {                                                                        \
+            sumR[c] = add(sumR[c], mul(load(row + c*W - t), k));                                      \
+            sumG[c] = add(sumG[c], mul(load(row + plane + c*W - t), k));                              \
+            sumB[c] = add(sumB[c], mul(load(row + 2*plane + c*W - t), k));                            \
+        }                                                                                             \
+    }                                                                                                 \
+    _Pragma("GCC unroll 4")                                                                           \
+    for (c=0;c<cols;c++) {                                                                            \
+        store(sums + c*W, sumR[c]);                                                                   \
+        store(sums + sumsPlane + c*W, sumG[c]);                                                       \
+        store(sums + 2*sumsPlane + c*W, sumB[c]);                                                     \
+    }                                                                                                 \
+}                                                                                                     \
+__attribute__((target(isa)))                                                                          \
+static int name(const float *in, long plane, long stride, int n,                                      \
+                const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane){  \
+    int end = n - n % W, from, to, j, m;                                                              \
+    for (from=0;from<end;from=to) {                                                                   \
+        to = MIN(from + BLOCKED_STRIP, end);                                                          \
+        for (m=0;m<kernelSizeY;m++) {                                                                 \
+            const float *row = in - m*stride, *kPtr = kernel + m*kernelSizeX;                         \
+            for (j=from;j+BLOCKED_TILE*W<=to;j+=BLOCKED_TILE*W)                                       \
+                name##Tile(row + j, plane, kPtr, kernelSizeX, m == 0, BLOCKED_TILE,                   \
+                           sums + j, sumsPlane);                                                      \
+            for (;j<to;j+=W)                                                                          \
+                name##Tile(row + j, plane, kPtr, kernelSizeX, m == 0, 1, sums + j, sumsPlane);        \
+        }                                                                                             \
+    }                                                                                                 \
+    return end;                                                                                       \
+}
+BLOCKED_ROW_ENGINE(blockedRowSSE42, "sse4.2", 4, __m128, _mm_setzero_ps, _mm_loadu_ps, _mm_storeu_ps,
+                   _mm_set1_ps, _mm_add_ps, _mm_mul_ps)
+BLOCKED_ROW_ENGINE(blockedRowAVX2, "avx2", 8, __m256, _mm256_setzero_ps, _mm256_loadu_ps, _mm256_storeu_ps,
+                   _mm256_set1_ps, _mm256_add_ps, _mm256_mul_ps)
+#undef BLOCKED_ROW_ENGINE
+
+__attribute__((target("avx512f"), optimize("fp-contract=off"))) static inline __attribute__((always_inline))
+void blockedRowAVX512Tile(const float *row, long plane, const float *kPtr, int kernelSizeX, int first, int cols,
+                          __mmask16 mask, float *sums, long sumsPlane){
+    __m512 sumR[BLOCKED_TILE], sumG[BLOCKED_TILE], sumB[BLOCKED_TILE];
+    int t, c;
+    #pragma GCC unroll 4
+    for (c=0;c<cols;c++) {
+        sumR[c] = first ? _mm512_setzero_ps() : _mm512_maskz_loadu_ps(mask, sums + c*16);
+        sumG[c] = first ? _mm512_setzero_ps() : _mm512_maskz_loadu_ps(mask, sums + sumsPlane + c*16);
+        sumB[c] = first ? _mm512_setzero_ps() : _mm512_maskz_loadu_ps(mask, sums + 2*sumsPlane + c*16);
     }
-    gettimeofday(&tim, NULL);
-    tread = tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
-    
-    //Duplicate the image struct.
+    for (t=0;t<kernelSizeX;t++) {
+        __m512 k = _mm512_set1_ps(kPtr[t]);
+        #pragma GCC unroll 4
+        for (c=0;c<cols;c++) {
+            sumR[c] = _mm512_add_ps(sumR[c], _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, row + c*16 - t), k));
+            sumG[c] = _mm512_add_ps(sumG[c], _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, row + plane + c*16 - t), k));
+            sumB[c] = _mm512_add_ps(sumB[c], _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, row + 2*plane + c*16 - t), k));
+        }
+    }
+    #pragma GCC unroll 4
+    for (c=0;c<cols;c++) {
+        _mm512_mask_storeu_ps(sums + c*16, mask, sumR[c]);
+        _mm512_mask_storeu_ps(sums + sumsPlane + c*16, mask, sumG[c]);
+        _mm512_mask_storeu_ps(sums + 2*sumsPlane + c*16, mask, sumB[c]);
+    }
+}
+
+// The last columns of the row are a masked vector
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static int blockedRowAVX512(const float *in, long plane, long stride, int n,
+                            const float *kernel, int kernelSizeX, int kernelSizeY, float *sums, long sumsPlane){
+    int from, to, j, m;
+    for (from=0;from<n;from=to) {
+        to = MIN(from + BLOCKED_STRIP, n);
+        for (m=0;m<kernelSizeY;m++) {
+            const float *row = in - m*stride, *kPtr = kernel + m*kernelSizeX;
+            for (j=from;j+BLOCKED_TILE*16<=to;j+=BLOCKED_TILE*16)
+                blockedRowAVX512Tile(row + j, plane, kPtr, kernelSizeX, m == 0, BLOCKED_TILE, 0xffff, sums + j, sumsPlane);
+            for (;j<to;j+=16) {
+                __mmask16 mask = (to - j >= 16) ? 0xffff : (__mmask16)((1u << (to - j)) - 1);
+                blockedRowAVX512Tile(row + j, plane, kPtr, kernelSizeX, m == 0, 1, mask, sums + j, sumsPlane);
+            }
+        }
+    }
+    return n;
+}
+#undef BLOCKED_STRIP
+#undef BLOCKED_TILE
+#endif
+#undef FIXED_SIZE_ENGINES
+
+// Sparse kernels: the same sums over a list of ntaps nonzero taps, the tap i at offset[i] floats
+// from in with the weight weight[i], in the order of the kernel.
+static int sparseRowScalar(const float *in, long plane, int from, int n,
+                           const long *offset, const float *weight, int ntaps, float *sums, long sumsPlane){
+    int j, t;
+    for (j=from;j<n;j++) {
+        float sumR = 0, sumG = 0, sumB = 0;
+        for (t=0;t<ntaps;t++) {
+            const float *p = in + j + offset[t];
+            float k = weight[t];
+            sumR += p[0] * k;
+            sumG += p[plane] * k;
+            sumB += p[2*plane] * k;
+        }
+        sums[j] = sumR;
+        sums[sumsPlane+j] = sumG;
+        sums[2*sumsPlane+j] = sumB;
+    }
+    return n;
+}
+
+typedef int (*sparseRowEngine)(const float *in, long plane, int n,
+                               const long *offset, const float *weight, int ntaps, float *sums, long sumsPlane);
+
+#ifdef X86_ENGINES
+#define SPARSE_ROW_ENGINE(name, isa, W, vec, zero, load, store, set1, add, mul)                       \
+__attribute__((target(isa)))                                                                          \
+static int name(const float *in, long plane, int n,                                                   \
+                const long *offset, const float *weight, int ntaps, float *sums, long sumsPlane){     \
+    int j, t;                                                                                         \
+    for (j=0;j+W<=n;j+=W) {                                                                           \
+        vec sumR = zero(), sumG = zero(), sumB = zero();                                              \
+        for (t=0;t<ntaps;t++) {                                                                       \
+            const float *p = in + j + offset[t];                                                      \
+            vec k = set1(weight[t]);                                                                  \
+            sumR = add(sumR, mul(load(p), k));                                                        \
+            sumG = add(sumG, mul(load(p + plane), k));                                                \
+            sumB = add(sumB, mul(load(p + 2*plane), k));                                              \
+        }                                                                                             \
+        store(sums + j, sumR);                                                                        \
+        store(sums + sumsPlane + j, sumG);                                                            \
+        store(sums + 2*sumsPlane + j, sumB);                                                          \
+    }                                                                                                 \
+    return j;                                                                                         \
+}
+SPARSE_ROW_ENGINE(sparseRowSSE42, "sse4.2", 4, __m128, _mm_setzero_ps, _mm_loadu_ps, _mm_storeu_ps,
+                  _mm_set1_ps, _mm_add_ps, _mm_mul_ps)
+SPARSE_ROW_ENGINE(sparseRowAVX2, "avx2", 8, __m256, _mm256_setzero_ps, _mm256_loadu_ps, _mm256_storeu_ps,
+                  _mm256_set1_ps, _mm256_add_ps, _mm256_mul_ps)
+#undef SPARSE_ROW_ENGINE
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static int sparseRowAVX512(const float *in, long plane, int n,
+                           const long *offset, const float *weight, int ntaps, float *sums, long sumsPlane){
+    int j, t;
+    for (j=0;j<n;j+=16) {
+        __mmask16 mask = (n - j >= 16) ? 0xffff : (__mmask16)((1u << (n - j)) - 1);
+        __m512 sumR = _mm512_setzero_ps(), sumG = _mm512_setzero_ps(), sumB = _mm512_setzero_ps();
+        for (t=0;t<ntaps;t++) {
+            const float *p = in + j + offset[t];
+            __m512 k = _mm512_set1_ps(weight[t]);
+            sumR = _mm512_add_ps(sumR, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, p), k));
+            sumG = _mm512_add_ps(sumG, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, p + plane), k));
+            sumB = _mm512_add_ps(sumB, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, p + 2*plane), k));
+        }
+        _mm512_mask_storeu_ps(sums + j, mask, sumR);
+        _mm512_mask_storeu_ps(sums + sumsPlane + j, mask, sumG);
+        _mm512_mask_storeu_ps(sums + 2*sumsPlane + j, mask, sumB);
+    }
+    return n;
+}
+#endif
+
+// Symmetric kernels: the taps with the same weight, mirrored left-right (hs), top-bottom (vs) or,
+// when there is neither, about the center (ps), have their samples added, or subtracted for an
+// antisymmetric kernel (sign -1), before one multiply by their weight. The samples are integers,
+// so their sums are exact in float and the result has one rounding less per pair than the direct
+// sum, but in a different order: a sample can differ by one where a sum falls very close to .5.
+// The signs are constants in every instantiation of the body, so its branches on them go away.
+// The engines start at the column from, and return the first column not done.
+typedef int (*symRowEngine)(const float *in, long plane, long stride, int from, int n, const float *kernel,
+                            int kernelSizeX, int kernelSizeY, int hs, int vs, int ps, float *sums, long sumsPlane);
+
+static inline float zeroScalar(void){ return 0; }
+static inline float loadScalar(const float *p){ return *p; }
+static inline void storeScalar(float *p, float v){ *p = v; }
+static inline float set1Scalar(float v){ return v; }
+static inline float addScalar(float a, float b){ return a + b; }
+static inline float subScalar(float a, float b){ return a - b; }
+static inline float mulScalar(float a, float b){ return a * b; }
+
+#define SYM_BODY(name, h, v, p) name##Body(in, plane, stride, from, n, kernel, kernelSizeX, kernelSizeY, h, v, p, sums, sumsPlane)
+#define SYM_ROW_ENGINE(name, attr, W, vec, zero, load, store, set1, add, sub, mul)                    \
+attr static inline __attribute__((always_inline)) vec name##Pair(vec a, vec b, int sign){             \
+    return sign > 0 ? add(a, b) : sub(a, b);                                                          \
+}                                                                                                     \
+/* Samples of the tap t of the row a, with its mirror u in the row (hs) and the row b below (vs) */   \
+attr static inline __attribute__((always_inline))                                                     \
+vec name##Tap(const float *a, const float *b, int t, int u, int hs, int vs){                          \
+    vec x = load(a - t);                                                                              \
+    if (vs) x = name##Pair(x, load(b - t), vs);                                                       \
+    if (hs) {                                                                                         \
+        vec y = load(a - u);                                                                          \
+        if (vs) y = name##Pair(y, load(b - u), vs);                                                   \
+        x = name##Pair(x, y, hs);                                                                     \
+    }                                                                                                 \
+    return x;                                                                                         \
+}                                                                                                     \
+/* One kernel row on the input row a, paired with the row b for vs, or point mirrored for ps */      \
+attr static inline __attribute__((always_inline))                                                     \
+void name##Row(const float *a, const float *b, long plane, const float *kPtr, int kernelSizeX,        \
+               int hs, int vs, int ps, vec *sumR, vec *sumG, vec *sumB){                              \
+    int t, half = hs ? kernelSizeX/2 : kernelSizeX;                                                   \
+    for (t=0;t<half;t++) {                                                                            \
+        vec k = set1(kPtr[t]);                                                                        \
+        if (ps) {                                                                                     \
+            int u = kernelSizeX-1-t;                                                                  \
+            *sumR = add(*sumR, mul(name##Pair(load(a - t), load(b - u), ps), k));                     \
+            *sumG = add(*sumG, mul(name##Pair(load(a + plane - t), load(b + plane - u), ps), k));     \
+            *sumB = add(*sumB, mul(name##Pair(load(a + 2*plane - t), load(b + 2*plane - u), ps), k)); \
+        }                                                                                             \
+        else {                                                                                        \
+            *sumR = add(*sumR, mul(name##Tap(a, b, t, kernelSizeX-1-t, hs, vs), k));                  \
+            *sumG = add(*sumG, mul(name##Tap(a + plane, b + plane, t, kernelSizeX-1-t, hs, vs), k));  \
+            *sumB = add(*sumB, mul(name##Tap(a + 2*plane, b + 2*plane, t, kernelSizeX-1-t, hs, vs), k)); \
+        }                                                                                             \
+    }                                                                                                 \
+    /* The middle tap of an odd row has no pair, and it is zero in an antisymmetric row */            \
+    if (hs > 0 && kernelSizeX % 2) {                                                                  \
+        vec k = set1(kPtr[t]);                                                                        \
+        *sumR = add(*sumR, mul(name##Tap(a, b, t, t, 0, vs), k));                                     \
+        *sumG = add(*sumG, mul(name##Tap(a + plane, b + plane, t, t, 0, vs), k));                     \
+        *sumB = add(*sumB, mul(name##Tap(a + 2*plane, b + 2*plane, t, t, 0, vs), k));                 \
+    }                                                                                                 \
+}                                                                                                     \
+attr static inline __attribute__((always_inline))                                                     \
+int name##Body(const float *in, long plane, long stride, int from, int n, const float *kernel,        \
+               int kernelSizeX, int kernelSizeY, int hs, int vs, int ps, float *sums, long sumsPlane){ \
+    int j, m, mid = kernelSizeY/2;                                                                    \
+    for (j=from;j+W<=n;j+=W) {                                                                        \
+        vec sumR = zero(), sumG = zero(), sumB = zero();                                              \
+        const float *row = in + j;                                                                    \
+        if (hs || vs) {                                                                               \
+            for (m=0;m<(vs ? mid : kernelSizeY);m++)                                                  \
+                name##Row(row - m*stride, row - (kernelSizeY-1-m)*stride, plane, kernel + m*kernelSizeX, \
+                          kernelSizeX, hs, vs, 0, &sumR, &sumG, &sumB);                               \
+            /* The middle row of an odd kernel has no pair, and it is zero if antisymmetric */        \
+            if (vs > 0 && kernelSizeY % 2)                                                            \
+                name##Row(row - mid*stride, NULL, plane, kernel + mid*kernelSizeX,                    \
+                          kernelSizeX, hs, 0, 0, &sumR, &sumG, &sumB);                                \
+        }                                                                                             \
+        else {                                                                                        \
+            for (m=0;m<mid;m++)                                                                       \
+                name##Row(row - m*stride, row - (kernelSizeY-1-m)*stride, plane, kernel + m*kernelSizeX, \
+                          kernelSizeX, 0, 0, ps, &sumR, &sumG, &sumB);                                \
+            /* The middle row of a point symmetric kernel is left-right symmetric */                  \
+            if (kernelSizeY % 2)                                                                      \
+                name##Row(row - mid*stride, NULL, plane, kernel + mid*kernelSizeX,                    \
+                          kernelSizeX, ps, 0, 0, &sumR, &sumG, &sumB);                                \
+        }                                                                                             \
+        store(sums + j, sumR);                                                                        \
+        store(sums + sumsPlane + j, sumG);                                                            \
+        store(sums + 2*sumsPlane + j, sumB);                                                          \
+    }                                                                                                 \
+    return j;                                                                                         \
+}                                                                                                     \
+attr static int name(const float *in, long plane, long stride, int from, int n, const float *kernel,  \
+                     int kernelSizeX, int kernelSizeY, int hs, int vs, int ps, float *sums, long sumsPlane){ \
+    if (hs == 0 && vs == 0) return ps > 0 ? SYM_BODY(name, 0, 0, 1) : SYM_BODY(name, 0, 0, -1);       \
+    if (hs == 0) return vs > 0 ? SYM_BODY(name, 0, 1, 0) : SYM_BODY(name, 0, -1, 0);                  \
+    if (vs == 0) return hs > 0 ? SYM_BODY(name, 1, 0, 0) : SYM_BODY(name, -1, 0, 0);                  \
+    if (hs > 0) return vs > 0 ? SYM_BODY(name, 1, 1, 0) : SYM_BODY(name, 1, -1, 0);                   \
+    return vs > 0 ? SYM_BODY(name, -1, 1, 0) : SYM_BODY(name, -1, -1, 0);                             \
+}
+SYM_ROW_ENGINE(symRowScalar, , 1, float, zeroScalar, loadScalar, storeScalar, set1Scalar, addScalar, subScalar, mulScalar)
+#ifdef X86_ENGINES
+SYM_ROW_ENGINE(symRowSSE42, __attribute__((target("sse4.2"))), 4, __m128, _mm_setzero_ps, _mm_loadu_ps, _mm_storeu_ps,
+               _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps)
+SYM_ROW_ENGINE(symRowAVX2, __attribute__((target("avx2"))), 8, __m256, _mm256_setzero_ps, _mm256_loadu_ps,
+               _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps)
+SYM_ROW_ENGINE(symRowAVX512, __attribute__((target("avx512f"), optimize("fp-contract=off"))), 16, __m512,
+               _mm512_setzero_ps, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_add_ps,
+               _mm512_sub_ps, _mm512_mul_ps)
+#endif
+#undef SYM_ROW_ENGINE
+#undef SYM_BODY
+
+// Winograd F(2x2,3x3) engines: one row of tiles, two output rows, of one channel. d0..d3 are the
+// four input rows under the tiles in the padded Winograd layout, every row stored as its even
+// columns followed by its odd ones, h = T+1 of each, so the 4x4 input tile of the tile c is made
+// of the columns c and c+1 of both halves. U is the 4x4 transformed kernel. The outputs of the
+// tiles are written in y0 and y1, 2*T pixels each. Plain loops that the compiler vectorizes
+// across tiles for every instruction set.
+typedef void (*winogradEngine)(const float *d0, const float *d1, const float *d2, const float *d3, int T,
+                               const float *U, float *y0, float *y1);
+
+// Rows of the input transform B^T d at the column x of the padded row
+#define WINOGRAD_T0(x) (d0[x] - d2[x])
+#define WINOGRAD_T1(x) (d1[x] + d2[x])
+#define WINOGRAD_T2(x) (d2[x] - d1[x])
+#define WINOGRAD_T3(x) (d1[x] - d3[x])
+// Input transform of the columns of the row k of the tile c, times U
+#define WINOGRAD_TILE_ROW(k)                                                                          \
+    float m##k##0 = U[4*k]   * (WINOGRAD_T##k(c) - WINOGRAD_T##k(c+1));                               \
+    float m##k##1 = U[4*k+1] * (WINOGRAD_T##k(h+c) + WINOGRAD_T##k(c+1));                             \
+    float m##k##2 = U[4*k+2] * (WINOGRAD_T##k(c+1) - WINOGRAD_T##k(h+c));                             \
+    float m##k##3 = U[4*k+3] * (WINOGRAD_T##k(h+c) - WINOGRAD_T##k(h+c+1));
+
+#define WINOGRAD_ROW_ENGINE(name, attr)                                                               \
+attr static void name(const float *d0, const float *d1, const float *d2, const float *d3, int T,     \
+                      const float *U, float *y0, float *y1){                                          \
+    int h = T + 1, c;                                                                                 \
+    /* Input transform, product by U and output transform A^T M A of every tile */                    \
+    _Pragma("omp simd")                                                                               \
+    for (c=0;c<T;c++) {                                                                               \
+        WINOGRAD_TILE_ROW(0)                                                                          \
+        WINOGRAD_TILE_ROW(1)                                                                          \
+        WINOGRAD_TILE_ROW(2)                                                                          \
+        WINOGRAD_TILE_ROW(3)                                                                          \
+        float s00 = m00 + m10 + m20, s01 = m01 + m11 + m21, s02 = m02 + m12 + m22, s03 = m03 + m13 + m23; \
+        float s10 = m10 - m20 - m30, s11 = m11 - m21 - m31, s12 = m12 - m22 - m32, s13 = m13 - m23 - m33; \
+        y0[2*c]   = s00 + s01 + s02;                                                                  \
+        y0[2*c+1] = s01 - s02 - s03;                                                                  \
+        y1[2*c]   = s10 + s11 + s12;                                                                  \
+        y1[2*c+1] = s11 - s12 - s13;                                                                  \
+    }                                                                                                 \
+}
+WINOGRAD_ROW_ENGINE(winogradRowScalar, )
+#ifdef X86_ENGINES
+WINOGRAD_ROW_ENGINE(winogradRowSSE42, __attribute__((target("sse4.2"))))
+WINOGRAD_ROW_ENGINE(winogradRowAVX2, __attribute__((target("avx2"))))
+WINOGRAD_ROW_ENGINE(winogradRowAVX512, __attribute__((target("avx512f"), optimize("fp-contract=off"))))
+#endif
+#undef WINOGRAD_ROW_ENGINE
+#undef WINOGRAD_TILE_ROW
+#undef WINOGRAD_T0
+#undef WINOGRAD_T1
+#undef WINOGRAD_T2
+#undef WINOGRAD_T3
+
+// Deriche recursive Gaussian engines: filter w <= GAUSSIAN_LINES lines of n samples at once, the
+// sample i of the line l being x[i*step + l], into y scaled by scale. The output is the sum of a
+// causal recursion, y+[i] = sum n[t]*x[i-t] - sum d[t]*y+[i-1-t], and an anticausal one,
+// y-[i] = sum m[t]*x[i+1+t] - sum d[t]*y-[i+1+t], t = 0..3, with zero states at both ends. The
+// states are kept in double, and x and y must not overlap. Plain loops that the compiler vectorizes
+// across lines for every instruction set.
+#define GAUSSIAN_LINES 16               // rows or columns filtered at once
+struct deriche{
+    double n[4], m[4], d[4];
+};
+typedef void (*dericheEngine)(const float *x, float *y, long step, int n, int w, const struct deriche *c, double scale);
+
+#define DERICHE_ENGINE(name, attr)                                                                    \
+attr static void name(const float *x, float *y, long step, int n, int w, const struct deriche *c, double scale){ \
+    double x1[GAUSSIAN_LINES], x2[GAUSSIAN_LINES], x3[GAUSSIAN_LINES], x4[GAUSSIAN_LINES];            \
+    double y1[GAUSSIAN_LINES], y2[GAUSSIAN_LINES], y3[GAUSSIAN_LINES], y4[GAUSSIAN_LINES];            \
+    int i, l;                                                                                         \
+    /* causal part, stored in y */                                                                    \
+    for (l=0;l<w;l++) x1[l] = x2[l] = x3[l] = y1[l] = y2[l] = y3[l] = y4[l] = 0;                      \
+    for (i=0;i<n;i++) {                                                                               \
+        const float *xi = x + i*step;                                                                 \
+        float *yi = y + i*step;                                                                       \
+        _Pragma("omp simd")                                                                           \
+        for (l=0;l<w;l++) {                                                                           \
+            double x0 = xi[l];                                                                        \
+            double v = c->n[0]*x0 + c->n[1]*x1[l] + c->n[2]*x2[l] + c->n[3]*x3[l]                     \
+                     - c->d[0]*y1[l] - c->d[1]*y2[l] - c->d[2]*y3[l] - c->d[3]*y4[l];                 \
+            x3[l] = x2[l]; x2[l] = x1[l]; x1[l] = x0;                                                 \
+            y4[l] = y3[l]; y3[l] = y2[l]; y2[l] = y1[l]; y1[l] = v;                                   \
+            yi[l] = v;                                                                                \
+        }                                                                                             \
+    }                                                                                                 \
+    /* anticausal part, added */                                                                      \
+    for (l=0;l<w;l++) x1[l] = x2[l] = x3[l] = x4[l] = y1[l] = y2[l] = y3[l] = y4[l] = 0;              \
+    for (i=n-1;i>=0;i--) {                                                                            \
+        const float *xi = x + i*step;                                                                 \
+        float *yi = y + i*step;                                                                       \
+        _Pragma("omp simd")                                                                           \
+        for (l=0;l<w;l++) {                                                                           \
+            double v = c->m[0]*x1[l] + c->m[1]*x2[l] + c->m[2]*x3[l] + c->m[3]*x4[l]                  \
+                     - c->d[0]*y1[l] - c->d[1]*y2[l] - c->d[2]*y3[l] - c->d[3]*y4[l];                 \
+            x4[l] = x3[l]; x3[l] = x2[l]; x2[l] = x1[l]; x1[l] = xi[l];                               \
+            y4[l] = y3[l]; y3[l] = y2[l]; y2[l] = y1[l]; y1[l] = v;                                   \
+            yi[l] = scale * (yi[l] + v);                                                              \
+        }                                                                                             \
+    }                                                                                                 \
+}
+DERICHE_ENGINE(dericheLinesScalar, )
+#ifdef X86_ENGINES
+DERICHE_ENGINE(dericheLinesSSE42, __attribute__((target("sse4.2"))))
+DERICHE_ENGINE(dericheLinesAVX2, __attribute__((target("avx2"))))
+DERICHE_ENGINE(dericheLinesAVX512, __attribute__((target("avx512f"), optimize("fp-contract=off"))))
+#endif
+#undef DERICHE_ENGINE
+
+// Integer engines: the exact sums of an integral kernel. The input holds every sample as a short
+// paired with the one on its left, in[q] = x[q] | x[q-1] << 16, and the taps of every kernel row are
+// packed in pairs the same way, pairs[m*((kernelSizeX+1)/2) + p] = K[m][2p] | K[m][2p+1] << 16 (0 past
+// the row), so one multiply-add of 16-bit lanes (pmaddwd) adds two taps of a column into its 32-bit
+// sum. When wide, the 32-bit sums of every kernel row are added into 64-bit ones, so only a row has
+// to fit in an int32. The sums are stored as int64 in sums[ch*sumsPlane + j]; as the float engines,
+// the SIMD ones start at the column 0 and return the first column not done.
+typedef int (*intRowEngine)(const int *in, long plane, long stride, int n, const int *pairs,
+                            int kernelSizeX, int kernelSizeY, int wide, long long *sums, long sumsPlane);
+
+static int intRowScalar(const int *in, long plane, long stride, int from, int n,
+                        const float *kernel, int kernelSizeX, int kernelSizeY, long long *sums, long sumsPlane){
+    int j, m, t;
+    for (j=from;j<n;j++) {
+        long long sumR = 0, sumG = 0, sumB = 0;
+        for (m=0;m<kernelSizeY;m++) {
+            const int *row = in + j - m*stride;
+            const float *kPtr = kernel + m*kernelSizeX;
+            for (t=0;t<kernelSizeX;t++) {
+                int k = (int)kPtr[t];
+                sumR += (row[-t] & 0xffff) * k;
+                sumG += (row[plane-t] & 0xffff) * k;
+                sumB += (row[2*plane-t] & 0xffff) * k;
+            }
+        }
+        sums[j] = sumR;
+        sums[sumsPlane+j] = sumG;
+        sums[2*sumsPlane+j] = sumB;
+    }
+    return n;
+}
+
+#ifdef X86_ENGINES
+// Store the 32-bit sums of an integer engine as int64, or add them unless init
+__attribute__((target("sse4.2"))) static inline void intStoreSSE42(long long *s, __m128i v, int init){
+    __m128i lo = _mm_cvtepi32_epi64(v), hi = _mm_cvtepi32_epi64(_mm_srli_si128(v, 8));
+    if (!init) {
+        lo = _mm_add_epi64(lo, _mm_loadu_si128((const __m128i *)s));
+        hi = _mm_add_epi64(hi, _mm_loadu_si128((const __m128i *)(s + 2)));
+    }
+    _mm_storeu_si128((__m128i *)s, lo);
+    _mm_storeu_si128((__m128i *)(s + 2), hi);
+}
+__attribute__((target("avx2"))) static inline void intStoreAVX2(long long *s, __m256i v, int init){
+    __m256i lo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)), hi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1));
+    if (!init) {
+        lo = _mm256_add_epi64(lo, _mm256_loadu_si256((const __m256i *)s));
+        hi = _mm256_add_epi64(hi, _mm256_loadu_si256((const __m256i *)(s + 4)));
+    }
+    _mm256_storeu_si256((__m256i *)s, lo);
+    _mm256_storeu_si256((__m256i *)(s + 4), hi);
+}
+__attribute__((target("avx512bw"))) static inline void intStoreAVX512(long long *s, __m512i v, int init){
+    __m512i lo = _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v)), hi = _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1));
+    if (!init) {
+        lo = _mm512_add_epi64(lo, _mm512_loadu_si512(s));
+        hi = _mm512_add_epi64(hi, _mm512_loadu_si512(s + 8));
+    }
+    _mm512_storeu_si512(s, lo);
+    _mm512_storeu_si512(s + 8, hi);
+}
+
+// The multiply-add of the pairs added to the sums, in one instruction with AVX-512 VNNI (vpdpwssd)
+#define INT_MADD_SSE42(sum, x, k) _mm_add_epi32(sum, _mm_madd_epi16(x, k))
+#define INT_MADD_AVX2(sum, x, k) _mm256_add_epi32(sum, _mm256_madd_epi16(x, k))
+#define INT_MADD_AVX512(sum, x, k) _mm512_add_epi32(sum, _mm512_madd_epi16(x, k))
+#define INT_MADD_VNNI(sum, x, k) _mm512_dpwssd_epi32(sum, x, k)
+#define INT_BLOCKS 4                    // vectors of columns of the integer engines
+// The sums of B vectors of columns at once, so 3*B independent chains of multiply-adds hide their
+// latency and every broadcast pair of taps is used B times
+#define INT_COLUMNS(B, W, vec, zero, load, set1, mac, store)                                          \
+    for (;j+B*W<=n;j+=B*W) {                                                                          \
+        vec sum[3*B];                                                                                 \
+        int c;                                                                                        \
+        for (c=0;c<3*B;c++) sum[c] = zero();                                                          \
+        for (m=0;m<kernelSizeY;m++) {                                                                 \
+            const int *row = in + j - m*stride, *kPtr = pairs + m*np;                                 \
+            for (p=0;p<np;p++) {                                                                      \
+                vec k = set1(kPtr[p]);                                                                \
+                _Pragma("GCC unroll 4")                                                               \
+                for (c=0;c<B;c++) {                                                                   \
+                    sum[c] = mac(sum[c], load((const vec *)(row + c*W - 2*p)), k);                    \
+                    sum[B+c] = mac(sum[B+c], load((const vec *)(row + plane + c*W - 2*p)), k);        \
+                    sum[2*B+c] = mac(sum[2*B+c], load((const vec *)(row + 2*plane + c*W - 2*p)), k);  \
+                }                                                                                     \
+            }                                                                                         \
+            if (wide || m == kernelSizeY - 1) {                                                       \
+                for (c=0;c<B;c++) {                                                                   \
+                    store(sums + j + c*W, sum[c], m == 0 || !wide);                                   \
+                    store(sums + sumsPlane + j + c*W, sum[B+c], m == 0 || !wide);                     \
+                    store(sums + 2*sumsPlane + j + c*W, sum[2*B+c], m == 0 || !wide);                 \
+                }                                                                                     \
+                for (c=0;c<3*B;c++) sum[c] = zero();                                                  \
+            }                                                                                         \
+        }                                                                                             \
+    }
+#define INT_ROW_ENGINE(name, isa, W, vec, zero, load, set1, mac, store)                               \
+__attribute__((target(isa))) static int name(const int *in, long plane, long stride, int n, const int *pairs, \
+                                             int kernelSizeX, int kernelSizeY, int wide, long long *sums, long sumsPlane){ \
+    int j = 0, m, p, np = (kernelSizeX + 1) / 2;                                                      \
+    INT_COLUMNS(INT_BLOCKS, W, vec, zero, load, set1, mac, store)                                     \
+    INT_COLUMNS(1, W, vec, zero, load, set1, mac, store)                                              \
+    return j;                                                                                         \
+}
+INT_ROW_ENGINE(intRowSSE42, "sse4.2", 4, __m128i, _mm_setzero_si128, _mm_loadu_si128, _mm_set1_epi32,
+               INT_MADD_SSE42, intStoreSSE42)
+INT_ROW_ENGINE(intRowAVX2, "avx2", 8, __m256i, _mm256_setzero_si256, _mm256_loadu_si256, _mm256_set1_epi32,
+               INT_MADD_AVX2, intStoreAVX2)
+INT_ROW_ENGINE(intRowAVX512, "avx512bw", 16, __m512i, _mm512_setzero_si512, _mm512_loadu_si512, _mm512_set1_epi32,
+               INT_MADD_AVX512, intStoreAVX512)
+INT_ROW_ENGINE(intRowVNNI, "avx512bw,avx512vnni", 16, __m512i, _mm512_setzero_si512, _mm512_loadu_si512,
+               _mm512_set1_epi32, INT_MADD_VNNI, intStoreAVX512)
+#undef INT_ROW_ENGINE
+#undef INT_COLUMNS
+#undef INT_BLOCKS
+#undef INT_MADD_SSE42
+#undef INT_MADD_AVX2
+#undef INT_MADD_AVX512
+#undef INT_MADD_VNNI
+#endif
+
+static sumRowEngine sumRow = NULL;     // NULL: scalar engine only
+static sumRowEngine sumRowFixed[3];    // 3x3, 5x5 and 7x7 engines of the same instruction set
+static sumRowEngine sumRowBlocked;     // Engine for kernels of BLOCKED_MIN_SIZE columns or more
+static sparseRowEngine sparseRow = NULL;
+static symRowEngine symRow = NULL;
+static winogradEngine winogradRow = winogradRowScalar;
+static dericheEngine dericheLines = dericheLinesScalar;
+static intRowEngine intRow = NULL;
+
+// Select the widest SIMD engine supported by the CPU, or the one named isa (NULL: any). Returns its
+// name, or NULL if the CPU does not support the requested one.
+const char *selectEngine(const char *isa){
+#define ENGINE_IS(name) (isa == NULL || strcasecmp(isa, name) == 0)
+    sumRow = NULL;
+    sparseRow = NULL;
+    symRow = NULL;
+    winogradRow = winogradRowScalar;
+    dericheLines = dericheLinesScalar;
+    intRow = NULL;
+#ifdef X86_ENGINES
+    __builtin_cpu_init();
+    if (ENGINE_IS("AVX-512") && __builtin_cpu_supports("avx512f")) {
+        sumRow = sumRowAVX512; sparseRow = sparseRowAVX512; symRow = symRowAVX512; winogradRow = winogradRowAVX512;
+        sumRowFixed[0] = sumRowAVX5123x3; sumRowFixed[1] = sumRowAVX5125x5; sumRowFixed[2] = sumRowAVX5127x7;
+        sumRowBlocked = blockedRowAVX512;
+        dericheLines = dericheLinesAVX512;
+        intRow = !__builtin_cpu_supports("avx512bw") ? intRowAVX2 :
+                 __builtin_cpu_supports("avx512vnni") ? intRowVNNI : intRowAVX512;
+        return "AVX-512";
+    }
+    if (ENGINE_IS("AVX2") && __builtin_cpu_supports("avx2")) {
+        sumRow = sumRowAVX2; sparseRow = sparseRowAVX2; symRow = symRowAVX2; winogradRow = winogradRowAVX2;
+        sumRowFixed[0] = sumRowAVX23x3; sumRowFixed[1] = sumRowAVX25x5; sumRowFixed[2] = sumRowAVX27x7;
+        sumRowBlocked = blockedRowAVX2;
+        dericheLines = dericheLinesAVX2;
+        intRow = intRowAVX2;
+        return "AVX2";
+    }
+    if (ENGINE_IS("SSE4.2") && __builtin_cpu_supports("sse4.2")) {
+        sumRow = sumRowSSE42; sparseRow = sparseRowSSE42; symRow = symRowSSE42; winogradRow = winogradRowSSE42;
+        sumRowFixed[0] = sumRowSSE423x3; sumRowFixed[1] = sumRowSSE425x5; sumRowFixed[2] = sumRowSSE427x7;
+        sumRowBlocked = blockedRowSSE42;
+        dericheLines = dericheLinesSSE42;
+        intRow = intRowSSE42;
+        return "SSE4.2";
+    }
+#endif
+    if (ENGINE_IS("scalar")) return "scalar";
+    return NULL;
+#undef ENGINE_IS
+}
+
+// SIMD engine for a kernel size: the unrolled one of a common size, the blocked one of a large
+// kernel, or the one for any size
+static sumRowEngine sumRowFor(int kernelSizeX, int kernelSizeY){
+    if (sumRow != NULL && kernelSizeX == kernelSizeY && (kernelSizeX == 3 || kernelSizeX == 5 || kernelSizeX == 7))
+        return sumRowFixed[kernelSizeX/2 - 1];
+#ifdef X86_ENGINES
+    if (sumRow != NULL && kernelSizeX >= BLOCKED_MIN_SIZE) return sumRowBlocked;
+#endif
+    return sumRow;
+}
+
+// Round and saturate the sums of n pixels of the three channels, sums[ch*sumsPlane + j], into
+// the output planes at the pixel o.
+static inline __attribute__((always_inline))
+void storeSums(void** out, long o, const float *sums, long sumsPlane, int n, int bytes, int maxcolor){
+    int j;
+    for(j = 0; j < n; ++j) {
+        SET_SAMPLE(out[0], o+j, bytes, saturateSum(sums[j], maxcolor));
+        SET_SAMPLE(out[1], o+j, bytes, saturateSum(sums[sumsPlane+j], maxcolor));
+        SET_SAMPLE(out[2], o+j, bytes, saturateSum(sums[2*sumsPlane+j], maxcolor));
+    }
+}
+
+// The method is direct, sparse (only the listed nonzero taps are added) or symmetric (the taps of the
+// same weight share a multiply), with the engines of each.
+static inline __attribute__((always_inline))
+int convolve2DSamples(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int method,
+                      int bytes, int maxcolor)
+{
+    int i, error = 0;
+    int kCenterX, kCenterY, padX, padY;
+    int kernelSizeX = kern->kernelX, kernelSizeY = kern->kernelY, ntaps = method == METHOD_SPARSE ? kern->ntaps : 0;
+    float *kernel = kern->vkern;
+    long stride, plane, *offset = NULL;
+    float *padded;
+    sumRowEngine engine = sumRowFor(kernelSizeX, kernelSizeY);
+    
+    // find center position of kernel (half of kernel size)
+    kCenterX = (int)kernelSizeX / 2;
+    kCenterY = (int)kernelSizeY / 2;
+    // the ghost border covers the kernel on both sides (even sizes are wider on one side)
+    padX = MAX(kCenterX, kernelSizeX - 1 - kCenterX);
+    padY = MAX(kCenterY, kernelSizeY - 1 - kCenterY);
+    stride = dataSizeX + 2*padX;
+    plane = stride * (dataSizeY + 2*padY);
+    if (ntaps > 0) {
+        // offsets of the taps from the input pixel under the tap (0,0)
+        if ((offset = malloc(ntaps*sizeof(long))) == NULL) return -1;
+        for (i=0;i<ntaps;i++) offset[i] = -kern->tapPos[2*i]*stride - kern->tapPos[2*i+1];
+    }
+    if ((padded = padPlanes(in, dataSizeX, dataSizeY, padX, padY, bytes)) == NULL) { free(offset); return -1; }
+    
+    // start convolution
+    #pragma omp parallel reduction(|:error)
+    {
+        float *sums = malloc(3*(size_t)dataSizeX*sizeof(float));
+        int j;
+        if (sums == NULL) error = 1;
+        else {
+            #pragma omp for schedule(dynamic)
+            for(i= 0; i < dataSizeY; ++i)               // number of rows
+            {
+                // the input pixel under the kernel tap (0,0), shifted (kCenterX, kCenterY)
+                const float *inPos = padded + (i + padY + kCenterY) * stride + padX + kCenterX;
+                long o = (long)i*dataSizeX;
+                
+                if (ntaps > 0) {
+                    j = sparseRow ? sparseRow(inPos, plane, dataSizeX, offset, kern->tapWeight, ntaps, sums, dataSizeX) : 0;
+                    sparseRowScalar(inPos, plane, j, dataSizeX, offset, kern->tapWeight, ntaps, sums, dataSizeX);
+                }
+                else if (method == METHOD_SYMMETRIC) {
+                    j = symRow ? symRow(inPos, plane, stride, 0, dataSizeX, kernel, kernelSizeX, kernelSizeY,
+                                        kern->hsym, kern->vsym, kern->psym, sums, dataSizeX) : 0;
+                    symRowScalar(inPos, plane, stride, j, dataSizeX, kernel, kernelSizeX, kernelSizeY,
+                                 kern->hsym, kern->vsym, kern->psym, sums, dataSizeX);
+                }
+                else {
+                    j = engine ? engine(inPos, plane, stride, dataSizeX, kernel, kernelSizeX, kernelSizeY, sums, dataSizeX) : 0;
+                    sumRowScalar(inPos, plane, stride, j, dataSizeX, kernel, kernelSizeX, kernelSizeY, sums, dataSizeX);
+                }
+                // convert to samples
+                storeSums(out, o, sums, dataSizeX, dataSizeX, bytes, maxcolor);
+            }
+            free(sums);
+        }
+    }
+    
+    free(padded);
+    free(offset);
+    return error ? -1 : 0;
+}
+
+int convolve2D(void** in, void** out, int dataSizeX, int dataSizeY,
+               float* kernel, int kernelSizeX, int kernelSizeY, int bytes, int maxcolor)
+{
+    struct structkernel k;
+    
+    // check validity of params
+    if(!in || !out || !kernel) return -1;
+    if(dataSizeX <= 0 || kernelSizeX <= 0) return -1;
+    
+    memset(&k, 0, sizeof(k));
+    k.kernelX = kernelSizeX;
+    k.kernelY = kernelSizeY;
+    k.vkern = kernel;
+    if (bytes == 1) return convolve2DSamples(in, out, dataSizeX, dataSizeY, &k, METHOD_DIRECT, 1, maxcolor);
+    return convolve2DSamples(in, out, dataSizeX, dataSizeY, &k, METHOD_DIRECT, 2, maxcolor);
+}
+
+// convolve2D over the list of nonzero taps of a sparse kernel
+int convolveSparse2D(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    if(!in || !out || !kern || kern->ntaps <= 0) return -1;
+    if(dataSizeX <= 0) return -1;
+    
+    if (bytes == 1) return convolve2DSamples(in, out, dataSizeX, dataSizeY, kern, METHOD_SPARSE, 1, maxcolor);
+    return convolve2DSamples(in, out, dataSizeX, dataSizeY, kern, METHOD_SPARSE, 2, maxcolor);
+}
+
+// convolve2D sharing the multiplies of the mirrored taps of a symmetric kernel
+int convolveSymmetric2D(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    if(!in || !out || !kern || (!kern->hsym && !kern->vsym && !kern->psym)) return -1;
+    if(dataSizeX <= 0) return -1;
+    
+    if (bytes == 1) return convolve2DSamples(in, out, dataSizeX, dataSizeY, kern, METHOD_SYMMETRIC, 1, maxcolor);
+    return convolve2DSamples(in, out, dataSizeX, dataSizeY, kern, METHOD_SYMMETRIC, 2, maxcolor);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Integer convolution: a kernel of integral taps applied to the samples as
+// shorts with the integer engines. The sums are exact, so no sample is rounded
+// differently than the exact convolution, and every 32-bit lane adds two taps
+// with one multiply-add, twice the taps of a float lane. The sums are int32, or
+// int64 added row by row of the kernel when the whole kernel could overflow an
+// int32 (see integerPossible).
+///////////////////////////////////////////////////////////////////////////////
+
+// Copy the three planes padded as padPlanes does, every sample paired with the one on its left as
+// the integer engines read them, x[q] | x[q-1] << 16
+static int *padPairedPlanes(void** in, int dataSizeX, int dataSizeY, int padX, int padY, int bytes){
+    size_t stride = (size_t)dataSizeX + 2*padX, plane = stride * ((size_t)dataSizeY + 2*padY);
+    int *padded = calloc(3*plane, sizeof(int));
+    int ch, i, j;
+    
+    if (padded == NULL) return NULL;
+    for (ch=0;ch<3;ch++) {
+        #pragma omp parallel for private(j) schedule(static)
+        for (i=0;i<dataSizeY;i++) {
+            int *row = padded + ch*plane + (i+padY)*stride + padX;
+            unsigned left = 0, x;
+            for (j=0;j<dataSizeX;j++) {
+                x = GET_SAMPLE(in[ch], (long)i*dataSizeX + j, bytes);
+                row[j] = x | left << 16;
+                left = x;
+            }
+            // the padding on the right of the last sample
+            if (padX > 0) row[dataSizeX] = left << 16;
+        }
+    }
+    return padded;
+}
+
+static inline long long saturateIntSum(long long sum, int maxcolor){
+    return sum <= 0 ? 0 : sum >= maxcolor ? maxcolor : sum;
+}
+
+static inline __attribute__((always_inline))
+int convolveIntegerSamples(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    int i, error = 0;
+    int kernelSizeX = kern->kernelX, kernelSizeY = kern->kernelY;
+    int kCenterX = kernelSizeX / 2, kCenterY = kernelSizeY / 2;
+    int padX = MAX(kCenterX, kernelSizeX - 1 - kCenterX), padY = MAX(kCenterY, kernelSizeY - 1 - kCenterY);
+    int wide = kern->tapSum * maxcolor > INTEGER_SUM_MAX;
+    long stride = dataSizeX + 2*padX, plane = stride * (dataSizeY + 2*padY);
+    int *padded;
+    
+    if ((padded = padPairedPlanes(in, dataSizeX, dataSizeY, padX, padY, bytes)) == NULL) return -1;
+    
+    #pragma omp parallel reduction(|:error)
+    {
+        long long *sums = malloc(3*(size_t)dataSizeX*sizeof(long long));
+        int j;
+        if (sums == NULL) error = 1;
+        else {
+            #pragma omp for schedule(dynamic)
+            for (i=0;i<dataSizeY;i++) {
+                // the input pixel under the kernel tap (0,0), shifted (kCenterX, kCenterY)
+                const int *inPos = padded + (i + padY + kCenterY) * stride + padX + kCenterX;
+                long o = (long)i*dataSizeX;
+                j = intRow ? intRow(inPos, plane, stride, dataSizeX, kern->pairs, kernelSizeX, kernelSizeY, wide, sums, dataSizeX) : 0;
+                intRowScalar(inPos, plane, stride, j, dataSizeX, kern->vkern, kernelSizeX, kernelSizeY, sums, dataSizeX);
+                for (j=0;j<dataSizeX;j++) {
+                    SET_SAMPLE(out[0], o+j, bytes, saturateIntSum(sums[j], maxcolor));
+                    SET_SAMPLE(out[1], o+j, bytes, saturateIntSum(sums[dataSizeX+j], maxcolor));
+                    SET_SAMPLE(out[2], o+j, bytes, saturateIntSum(sums[2*dataSizeX+j], maxcolor));
+                }
+            }
+            free(sums);
+        }
+    }
+    
+    free(padded);
+    return error ? -1 : 0;
+}
+
+int convolveInteger2D(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    if(!in || !out || !kern || !integerPossible(kern, maxcolor)) return -1;
+    if(dataSizeX <= 0) return -1;
+    
+    if (bytes == 1) return convolveIntegerSamples(in, out, dataSizeX, dataSizeY, kern, 1, maxcolor);
+    return convolveIntegerSamples(in, out, dataSizeX, dataSizeY, kern, 2, maxcolor);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Separable 2D convolution: for a rank 1 kernel, K[m][n] = vcol[m]*vrow[n], a
+// horizontal pass with vrow over all the padded rows and a vertical pass with
+// vcol over its result take kernelX+kernelY multiplies per pixel instead of
+// kernelX*kernelY. Both passes run on the same SIMD engines as convolve2D.
+// The sums are rounded in a different order than the 2D ones, so a sample can
+// differ by one where a 2D sum falls very close to .5.
+///////////////////////////////////////////////////////////////////////////////
+static inline __attribute__((always_inline))
+int convolveSeparableSamples(void** in, void** out, int dataSizeX, int dataSizeY,
+                             float* vcol, float* vrow, int kernelSizeX, int kernelSizeY, int bytes, int maxcolor)
+{
+    int i, r, error = 0;
+    int kCenterX = kernelSizeX / 2, kCenterY = kernelSizeY / 2;
+    int padX = MAX(kCenterX, kernelSizeX - 1 - kCenterX), padY = MAX(kCenterY, kernelSizeY - 1 - kCenterY);
+    int rows = dataSizeY + 2*padY;
+    long stride = dataSizeX + 2*padX, plane = stride * rows, tplane = (long)dataSizeX * rows;
+    float *padded, *tmp;
+    sumRowEngine engine = sumRowFor(kernelSizeX, 1);
+    
+    if ((padded = padPlanes(in, dataSizeX, dataSizeY, padX, padY, bytes)) == NULL) return -1;
+    if ((tmp = malloc(3*tplane*sizeof(float))) == NULL) { free(padded); return -1; }
+    
+    // Horizontal pass over every padded row, the ghost rows give the zero rows of tmp
+    #pragma omp parallel for schedule(static)
+    for (r=0;r<rows;r++) {
+        const float *inPos = padded + r*stride + padX + kCenterX;
+        int j = engine ? engine(inPos, plane, stride, dataSizeX, vrow, kernelSizeX, 1, tmp + (long)r*dataSizeX, tplane) : 0;
+        sumRowScalar(inPos, plane, stride, j, dataSizeX, vrow, kernelSizeX, 1, tmp + (long)r*dataSizeX, tplane);
+    }
+    free(padded);
+    
+    // Vertical pass
+    #pragma omp parallel reduction(|:error)
+    {
+        float *sums = malloc(3*(size_t)dataSizeX*sizeof(float));
+        if (sums == NULL) error = 1;
+        else {
+            #pragma omp for schedule(static)
+            for (i=0;i<dataSizeY;i++) {
+                const float *inPos = tmp + (long)(i + padY + kCenterY) * dataSizeX;
+                int j = sumRow ? sumRow(inPos, tplane, dataSizeX, dataSizeX, vcol, 1, kernelSizeY, sums, dataSizeX) : 0;
+                sumRowScalar(inPos, tplane, dataSizeX, j, dataSizeX, vcol, 1, kernelSizeY, sums, dataSizeX);
+                storeSums(out, (long)i*dataSizeX, sums, dataSizeX, dataSizeX, bytes, maxcolor);
+            }
+            free(sums);
+        }
+    }
+    
+    free(tmp);
+    return error ? -1 : 0;
+}
+
+int convolveSeparable2D(void** in, void** out, int dataSizeX, int dataSizeY,
+                        float* vcol, float* vrow, int kernelSizeX, int kernelSizeY, int bytes, int maxcolor)
+{
+    if(!in || !out || !vcol || !vrow) return -1;
+    if(dataSizeX <= 0 || kernelSizeX <= 0) return -1;
+    
+    if (bytes == 1) return convolveSeparableSamples(in, out, dataSizeX, dataSizeY, vcol, vrow, kernelSizeX, kernelSizeY, 1, maxcolor);
+    return convolveSeparableSamples(in, out, dataSizeX, dataSizeY, vcol, vrow, kernelSizeX, kernelSizeY, 2, maxcolor);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Winograd F(2x2,3x3) convolution for 3x3 kernels: every 2x2 output tile is
+// computed from its 4x4 input tile d as A^T [U .* (B^T d B)] A, with the kernel
+// transformed once, U = G g G^T, where g is the kernel flipped, as convolve2D
+// flips it. That is 16 multiplies per 4 pixels instead of 36.
+// The planes are padded with one zero row and column on the top and the left,
+// and enough on the bottom and the right for whole tiles, and every padded row
+// is stored as its even columns followed by its odd ones, so the tiles of a row
+// are processed with contiguous loads, vectorized across tiles.
+// The transforms add and subtract in a different order than the direct sum,
+// so a sample can differ by one where a direct sum falls very close to .5.
+///////////////////////////////////////////////////////////////////////////////
+
+// Transformed 3x3 kernel, U = G g G^T with g[u][v] = kernel[2-u][2-v]
+static void winogradKernel(const float *kernel, float *U){
+    static const float G[4][3] = {{1, 0, 0}, {0.5f, 0.5f, 0.5f}, {0.5f, -0.5f, 0.5f}, {0, 0, 1}};
+    float Gg[4][3];
+    int a, b, u;
+    for (a=0;a<4;a++)
+        for (b=0;b<3;b++) {
+            Gg[a][b] = 0;
+            for (u=0;u<3;u++) Gg[a][b] += G[a][u] * kernel[(2-u)*3 + 2-b];
+        }
+    for (a=0;a<4;a++)
+        for (b=0;b<4;b++) {
+            U[4*a+b] = 0;
+            for (u=0;u<3;u++) U[4*a+b] += Gg[a][u] * G[b][u];
+        }
+}
+
+static inline __attribute__((always_inline))
+int convolveWinogradSamples(void** in, void** out, int dataSizeX, int dataSizeY, float* kernel, int bytes, int maxcolor)
+{
+    int T = (dataSizeX + 1) / 2, h = T + 1, rows = 2*((dataSizeY + 1) / 2) + 2;
+    long width = 2*h, plane = width * rows;
+    int i, ch, error = 0;
+    float U[16], *padded;
+    
+    winogradKernel(kernel, U);
+    if ((padded = calloc(3*plane, sizeof(float))) == NULL) return -1;
+    // Pixel (r,c) goes to the padded row r+1 and column c+1, in the half of its parity
+    for (ch=0;ch<3;ch++) {
+        #pragma omp parallel for schedule(static)
+        for (i=0;i<dataSizeY;i++) {
+            float *row = padded + ch*plane + (i+1)*width;
+            long first = (long)i*dataSizeX;
+            int c;
+            for (c=1;c<dataSizeX;c+=2) row[(c+1)/2] = GET_SAMPLE(in[ch], first+c, bytes);
+            for (c=0;c<dataSizeX;c+=2) row[h + c/2] = GET_SAMPLE(in[ch], first+c, bytes);
+        }
+    }
+    
+    #pragma omp parallel reduction(|:error)
+    {
+        float *y = malloc(12*(size_t)T*sizeof(float));
+        if (y == NULL) error = 1;
+        else {
+            #pragma omp for schedule(dynamic)
+            for (i=0;i<dataSizeY;i+=2) {
+                int c;
+                for (c=0;c<3;c++) {
+                    const float *d = padded + c*plane + (long)i*width;
+                    winogradRow(d, d + width, d + 2*width, d + 3*width, T, U, y + c*2*T, y + (3+c)*2*T);
+                }
+                storeSums(out, (long)i*dataSizeX, y, 2*T, dataSizeX, bytes, maxcolor);
+                if (i+1 < dataSizeY) storeSums(out, (long)(i+1)*dataSizeX, y + 6*T, 2*T, dataSizeX, bytes, maxcolor);
+            }
+        }
+        free(y);
+    }
+    
+    free(padded);
+    return error ? -1 : 0;
+}
+
+int convolveWinograd2D(void** in, void** out, int dataSizeX, int dataSizeY, float* kernel, int bytes, int maxcolor)
+{
+    if(!in || !out || !kernel) return -1;
+    if(dataSizeX <= 0) return -1;
+    
+    if (bytes == 1) return convolveWinogradSamples(in, out, dataSizeX, dataSizeY, kernel, 1, maxcolor);
+    return convolveWinogradSamples(in, out, dataSizeX, dataSizeY, kernel, 2, maxcolor);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FFT convolution with overlap-add tiles, for large kernels. The chunk is split
+// in tiles of B x B pixels. Every tile is zero padded to N x N, N = B+k-1 a power
+// of 2, transformed, multiplied by the spectrum of the kernel and transformed
+// back, giving its full linear convolution, which is added to the result planes
+// at the tile position. R and G are transformed together as the real and the
+// imaginary parts of one complex tile, B alone.
+// The tiles are processed in 4 phases by the parity of their row and column: as
+// B >= k-1, the tiles of a phase never add to the same pixels and they run in
+// parallel. The spectrum of the kernel is computed once per tile size.
+// Tolerance: the transforms are in double precision and only the sums of the up
+// to 4 tiles over a pixel are added in float, so a result is the exactly rounded
+// sum while the sums stay below 2^24, as with the 8-bit images. It differs from
+// convolve2D by the error of convolve2D's float accumulation of kX*kY products,
+// which grows with the kernel size and maxcolor: up to 9 with a 25x25 integral
+// kernel on a 16-bit image, where the FFT gives the exact sum.
+///////////////////////////////////////////////////////////////////////////////
+#define FFT_MIN_SIZE 16
+#define FFT_MAX_SIZE 1024
+
+static inline double complex cmul(double complex a, double complex b){
+    return CMPLX(creal(a)*creal(b) - cimag(a)*cimag(b), creal(a)*cimag(b) + cimag(a)*creal(b));
+}
+
+// In place radix-2 FFT of the n points of a. The inverse is not scaled.
+static void fft1D(double complex *a, int n, const int *bitrev, const double complex *twiddle, int inverse){
+    int i, j, len;
+    for (i=0;i<n;i++) {
+        j = bitrev[i];
+        if (i < j) { double complex t = a[i]; a[i] = a[j]; a[j] = t; }
+    }
+    for (len=2; len<=n; len<<=1) {
+        int half = len/2, step = n/len;
+        for (i=0;i<n;i+=len)
+            for (j=0;j<half;j++) {
+                double complex w = inverse ? conj(twiddle[j*step]) : twiddle[j*step];
+                double complex u = a[i+j], v = cmul(a[i+j+half], w);
+                a[i+j] = u + v;
+                a[i+j+half] = u - v;
+            }
+    }
+}
+
+// In place transpose of the n x n matrix a, by blocks
+static void transpose(double complex *a, int n){
+    int bi, bj, i, j;
+    for (bi=0;bi<n;bi+=16)
+        for (bj=bi;bj<n;bj+=16)
+            for (i=bi;i<MIN(bi+16,n);i++)
+                for (j=(bi==bj ? i+1 : bj);j<MIN(bj+16,n);j++) {
+                    double complex t = a[i*n+j]; a[i*n+j] = a[j*n+i]; a[j*n+i] = t;
+                }
+}
+
+// 2D FFT of the n x n tile a, where only the first rows rows are not zero. The forward transform
+// is left transposed and the inverse one expects it transposed, which is the same for the kernel.
+static void fft2D(double complex *a, int n, int rows, const int *bitrev, const double complex *twiddle, int inverse){
+    int r;
+    for (r=0;r<rows;r++) fft1D(a + (long)r*n, n, bitrev, twiddle, inverse);
+    transpose(a, n);
+    for (r=0;r<n;r++) fft1D(a + (long)r*n, n, bitrev, twiddle, inverse);
+}
+
+// Tiles of B x B pixels needed by a dataSizeX x dataSizeY chunk
+static inline long fftTiles(int b, int dataSizeX, int dataSizeY){
+    return (long)((dataSizeX + b - 1) / b) * ((dataSizeY + b - 1) / b);
+}
+
+// FFT size for a k x k kernel and a dataSizeX x dataSizeY chunk: the power of 2 that minimizes the
+// work of all the tiles, tiles*N*N*log2(N) with B = N-k+1, keeping B >= k-1 for the tile phases.
+static int fftTileSize(int k, int dataSizeX, int dataSizeY){
+    int n, best = 0;
+    double cost, bestcost = 0;
+    for (n=FFT_MIN_SIZE; n<=FFT_MAX_SIZE; n*=2) {
+        int b = n - k + 1;
+        if (b < k - 1 || b < 1) continue;
+        cost = (double)n*n*log2(n) * fftTiles(b, dataSizeX, dataSizeY);
+        if (best == 0 || cost < bestcost) { best = n; bestcost = cost; }
+    }
+    return best;
+}
+
+// Twiddles, bit reversal and the spectrum of the kernel for the FFT size n, kept in the kernel.
+static int prepareSpectrum(kernelData kern, int n){
+    int i, m, log2n = 0;
+    
+    if (kern->fftsize == n) return 0;
+    free(kern->spectrum); free(kern->twiddle); free(kern->bitrev);
+    kern->fftsize = 0;
+    kern->spectrum = malloc((size_t)n*n*sizeof(double complex));
+    kern->twiddle = malloc(n/2*sizeof(double complex));
+    kern->bitrev = malloc(n*sizeof(int));
+    if (kern->spectrum == NULL || kern->twiddle == NULL || kern->bitrev == NULL) return -1;
+    while ((1 << log2n) < n) log2n++;
+    for (i=0;i<n/2;i++) kern->twiddle[i] = cexp(-2*M_PI*I*i/n);
+    for (i=0;i<n;i++) {
+        int r = 0;
+        for (m=0;m<log2n;m++) if (i & (1 << m)) r |= 1 << (log2n-1-m);
+        kern->bitrev[i] = r;
+    }
+    memset(kern->spectrum, 0, (size_t)n*n*sizeof(double complex));
+    for (m=0;m<kern->kernelY;m++)
+        for (i=0;i<kern->kernelX;i++) kern->spectrum[(long)m*n+i] = kern->vkern[m*kern->kernelX+i];
+    fft2D(kern->spectrum, n, kern->kernelY, kern->bitrev, kern->twiddle, 0);
+    kern->fftsize = n;
+    return 0;
+}
+
+static inline __attribute__((always_inline))
+int convolveFFTSamples(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    int kX = kern->kernelX, kY = kern->kernelY, kCenterX = kX / 2, kCenterY = kY / 2;
+    int n = fftTileSize(MAX(kX, kY), dataSizeX, dataSizeY), b = n - MAX(kX, kY) + 1;
+    int tilesX = (dataSizeX + b - 1) / b, tilesY = (dataSizeY + b - 1) / b, phase, t, i, error = 0;
+    long accX = dataSizeX + kX - 1, accY = dataSizeY + kY - 1, plane = accX * accY;
+    float *acc;
+    
+    if (n == 0 || prepareSpectrum(kern, n)) return -1;
+    if ((acc = calloc(3*plane, sizeof(float))) == NULL) return -1;
+    
+    #pragma omp parallel private(phase, t) reduction(|:error)
+    {
+        double complex *rg = malloc((size_t)n*n*sizeof(double complex));
+        double complex *bl = malloc((size_t)n*n*sizeof(double complex));
+        const double complex *spectrum = kern->spectrum;
+        double scale = 1.0 / ((double)n*n);
+        if (rg == NULL || bl == NULL) error = 1;
+        for (phase=0; phase<4; phase++) {
+            #pragma omp for schedule(dynamic)
+            for (t=0; t<tilesX*tilesY; t++) {
+                int ty = t / tilesX, tx = t % tilesX, y, x;
+                int y0 = ty*b, x0 = tx*b, h = MIN(b, dataSizeY - y0), w = MIN(b, dataSizeX - x0);
+                long s;
+                if (error || (ty%2)*2 + tx%2 != phase) continue;
+                memset(rg, 0, (size_t)n*n*sizeof(double complex));
+                memset(bl, 0, (size_t)n*n*sizeof(double complex));
+                for (y=0;y<h;y++)
+                    for (x=0;x<w;x++) {
+                        long p = (long)(y0+y)*dataSizeX + x0+x;
+                        rg[(long)y*n+x] = CMPLX(GET_SAMPLE(in[0], p, bytes), GET_SAMPLE(in[1], p, bytes));
+                        bl[(long)y*n+x] = GET_SAMPLE(in[2], p, bytes);
+                    }
+                fft2D(rg, n, h, kern->bitrev, kern->twiddle, 0);
+                fft2D(bl, n, h, kern->bitrev, kern->twiddle, 0);
+                for (s=0;s<(long)n*n;s++) {
+                    rg[s] = cmul(rg[s], spectrum[s]);
+                    bl[s] = cmul(bl[s], spectrum[s]);
+                }
+                fft2D(rg, n, n, kern->bitrev, kern->twiddle, 1);
+                fft2D(bl, n, n, kern->bitrev, kern->twiddle, 1);
+                // Add the full convolution of the tile, h+kY-1 x w+kX-1 pixels
+                for (y=0;y<h+kY-1;y++)
+                    for (x=0;x<w+kX-1;x++) {
+                        long a = (long)(y0+y)*accX + x0+x, p = (long)y*n+x;
+                        acc[a]         += creal(rg[p]) * scale;
+                        acc[plane+a]   += cimag(rg[p]) * scale;
+                        acc[2*plane+a] += creal(bl[p]) * scale;
+                    }
+            }
+        }
+        free(rg);
+        free(bl);
+    }
+    
+    // The output pixel (i,j) is the full convolution at (i+kCenterY, j+kCenterX)
+    if (!error) {
+        #pragma omp parallel for schedule(static)
+        for (i=0;i<dataSizeY;i++)
+            storeSums(out, (long)i*dataSizeX, acc + (i+kCenterY)*accX + kCenterX, plane, dataSizeX, bytes, maxcolor);
+    }
+    free(acc);
+    return error ? -1 : 0;
+}
+
+int convolveFFT2D(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    if(!in || !out || !kern) return -1;
+    if(dataSizeX <= 0 || kern->kernelX <= 0) return -1;
+    
+    if (bytes == 1) return convolveFFTSamples(in, out, dataSizeX, dataSizeY, kern, 1, maxcolor);
+    return convolveFFTSamples(in, out, dataSizeX, dataSizeY, kern, 2, maxcolor);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Box and Gaussian kernels in constant time per pixel, whatever their size.
+// A box kernel, all its taps equal to w, gives w times the sum of the samples
+// under it, read with 4 lookups from a summed-area table of the plane. The table
+// is kept in unsigned ints that wrap around: a box sum is a difference of table
+// entries, exact modulo 2^32, and the sum of kX*kY samples never reaches 2^32
+// while kX*kY <= BOX_MAX_TAPS. The sums are exact, so a sample only differs from
+// convolve2D where its float sum falls very close to .5.
+// A Gaussian kernel is applied with the 4th order recursive filter of Deriche:
+// a causal and an anticausal recursion down the columns, and then along the
+// rows, 16 multiply-adds per pixel and pass for any sigma. findBlur only
+// takes a kernel for a Gaussian when the L1 distance between its taps and the
+// impulse response of the filter, both of unit sum, is at most GAUSSIAN_TOLERANCE,
+// so a sample differs from convolve2D at most GAUSSIAN_TOLERANCE*|gain|*maxcolor
+// plus the rounding, gain being the sum of the taps. The recursions start with
+// zero states at the borders of the chunk, the zero ghost border of convolve2D.
+// planKernel only picks it by itself when that bound is under one output level.
+///////////////////////////////////////////////////////////////////////////////
+#define BOX_MAX_TAPS 65537              // kX*kY*65535 < 2^32
+#define BOX_COLUMNS 1024                // columns of the table summed down by a thread at once
+#define GAUSSIAN_TOLERANCE 5e-3
+
+// Recursion coefficients of the Gaussian of the given sigma, scaled to a unit gain
+static void dericheCoefficients(double sigma, struct deriche *c){
+    // The Gaussian fitted as a sum of two damped cosines and sines
+    const double a0 = 1.680, a1 = 3.735, b0 = 1.783, b1 = 1.723, c0 = -0.6803, c1 = -0.2598, w0 = 0.6318, w1 = 1.997;
+    double e0 = exp(-b0/sigma), e1 = exp(-b1/sigma), cos0 = cos(w0/sigma), sin0 = sin(w0/sigma);
+    double cos1 = cos(w1/sigma), sin1 = sin(w1/sigma), gain;
+    int t;
+    
+    c->n[0] = a0 + c0;
+    c->n[1] = e1*(c1*sin1 - (c0 + 2*a0)*cos1) + e0*(a1*sin0 - (2*c0 + a0)*cos0);
+    c->n[2] = 2*e0*e1*((a0 + c0)*cos1*cos0 - a1*cos1*sin0 - c1*cos0*sin1) + c0*e0*e0 + a0*e1*e1;
+    c->n[3] = e1*e0*e0*(c1*sin1 - c0*cos1) + e0*e1*e1*(a1*sin0 - a0*cos0);
+    c->d[0] = -2*e1*cos1 - 2*e0*cos0;
+    c->d[1] = 4*cos1*cos0*e0*e1 + e1*e1 + e0*e0;
+    c->d[2] = -2*cos0*e0*e1*e1 - 2*cos1*e1*e0*e0;
+    c->d[3] = e0*e0*e1*e1;
+    for (t=0;t<3;t++) c->m[t] = c->n[t+1] - c->d[t]*c->n[0];
+    c->m[3] = -c->d[3]*c->n[0];
+    gain = (c->n[0] + c->n[1] + c->n[2] + c->n[3] + c->m[0] + c->m[1] + c->m[2] + c->m[3]) /
+           (1 + c->d[0] + c->d[1] + c->d[2] + c->d[3]);
+    for (t=0;t<4;t++) { c->n[t] /= gain; c->m[t] /= gain; }
+}
+
+// Standard deviation of the Gaussian sampled in the n taps of v around the middle one, 0 if none.
+// The variance of the taps is matched with the one of the Gaussian truncated to the same taps.
+static double fitSigma(const double *v, int n){
+    double sum = 0, var = 0, sigma, g, gsum, gvar;
+    int i, t, c = n/2;
+    
+    for (i=0;i<n;i++) { sum += v[i]; var += (double)(i-c)*(i-c)*v[i]; }
+    if (sum == 0 || var / sum <= 0) return 0;
+    var /= sum;
+    sigma = sqrt(var);
+    for (t=0;t<50 && sigma < n;t++) {
+        gsum = gvar = 0;
+        for (i=0;i<n;i++) {
+            g = exp(-(double)(i-c)*(i-c) / (2*sigma*sigma));
+            gsum += g;
+            gvar += (double)(i-c)*(i-c)*g;
+        }
+        sigma *= sqrt(var / (gvar / gsum));
+    }
+    return sigma < n ? sigma : 0;
+}
+
+// Impulse response of the recursive filter, for an impulse in the middle of n samples, or NULL
+static float *dericheImpulse(double sigma, int n){
+    float *x = calloc(n, sizeof(float)), *h = malloc(n*sizeof(float));
+    struct deriche c;
+    
+    if (x != NULL && h != NULL) {
+        x[n/2] = 1;
+        dericheCoefficients(sigma, &c);
+        dericheLinesScalar(x, h, 1, n, 1, &c, 1);
+    }
+    else { free(h); h = NULL; }
+    free(x);
+    return h;
+}
+
+// L1 distance between the taps divided by gain and the impulse response of the recursive filter,
+// including the part of the response out of the kernel, or 1 if it can not be computed.
+static double gaussianError(const float *k, int kX, int kY, double gain, double sigmaX, double sigmaY){
+    int ex = (int)ceil(10*sigmaX), ey = (int)ceil(10*sigmaY), m, n;
+    float *hx = dericheImpulse(sigmaX, kX + 2*ex), *hy = dericheImpulse(sigmaY, kY + 2*ey);
+    double error = 1, lx = 0, ly = 0, ix = 0, iy = 0;
+    
+    if (hx != NULL && hy != NULL) {
+        for (n=0;n<kX+2*ex;n++) { lx += fabs(hx[n]); if (n >= ex && n < ex+kX) ix += fabs(hx[n]); }
+        for (m=0;m<kY+2*ey;m++) { ly += fabs(hy[m]); if (m >= ey && m < ey+kY) iy += fabs(hy[m]); }
+        error = lx*ly - ix*iy;
+        for (m=0;m<kY;m++)
+            for (n=0;n<kX;n++)
+                error += fabs(k[m*kX+n] / gain - (double)hy[ey+m]*hx[ex+n]);
+    }
+    free(hx);
+    free(hy);
+    return error;
+}
+
+// Find if the kernel is a box, all the taps equal, or a Gaussian within GAUSSIAN_TOLERANCE, fitted
+// to the sums of its rows and columns. Both are applied in constant time per pixel.
+void findBlur(kernelData kern){
+    int m, n, kX = kern->kernelX, kY = kern->kernelY;
+    const float *k = kern->vkern;
+    double *colSum, *rowSum, gain = 0, sigmaX, sigmaY;
+    
+    kern->box = kX*kY <= BOX_MAX_TAPS && k[0] != 0;
+    for (m=1;m<kX*kY && kern->box;m++) kern->box = k[m] == k[0];
+    kern->sigmaX = kern->sigmaY = kern->gain = 0;
+    if (kern->box || kX < 3 || kY < 3 || kX % 2 == 0 || kY % 2 == 0) return;
+    
+    if ((colSum = calloc(kY, sizeof(double))) == NULL) return;
+    if ((rowSum = calloc(kX, sizeof(double))) == NULL) { free(colSum); return; }
+    for (m=0;m<kY;m++)
+        for (n=0;n<kX;n++) {
+            colSum[m] += k[m*kX+n];
+            rowSum[n] += k[m*kX+n];
+            gain += k[m*kX+n];
+        }
+    sigmaX = fitSigma(rowSum, kX);
+    sigmaY = fitSigma(colSum, kY);
+    if (gain != 0 && sigmaX > 0 && sigmaY > 0 && gaussianError(k, kX, kY, gain, sigmaX, sigmaY) <= GAUSSIAN_TOLERANCE) {
+        kern->sigmaX = sigmaX;
+        kern->sigmaY = sigmaY;
+        kern->gain = gain;
+    }
+    free(colSum);
+    free(rowSum);
+}
+
+static inline __attribute__((always_inline))
+int convolveBoxSamples(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    int kernelSizeX = kern->kernelX, kernelSizeY = kern->kernelY;
+    int kCenterX = kernelSizeX / 2, kCenterY = kernelSizeY / 2, ch, i, b;
+    long stride = dataSizeX + 1;
+    unsigned int *table = malloc(stride * (dataSizeY + 1) * sizeof(unsigned int));
+    float w = kern->vkern[0];
+    
+    if (table == NULL) return -1;
+    // The row and the column 0 of the table are zero, table[i][j] sums the samples above and left of (i,j)
+    memset(table, 0, stride * sizeof(unsigned int));
+    for (ch=0;ch<3;ch++) {
+        // sums along the rows
+        #pragma omp parallel for schedule(static)
+        for (i=0;i<dataSizeY;i++) {
+            unsigned int *row = table + (i+1)*stride, sum = 0;
+            long first = (long)i*dataSizeX;
+            int j;
+            row[0] = 0;
+            for (j=0;j<dataSizeX;j++) {
+                sum += GET_SAMPLE(in[ch], first+j, bytes);
+                row[j+1] = sum;
+            }
+        }
+        // and down the columns, a block of columns per thread
+        #pragma omp parallel for schedule(static)
+        for (b=1;b<stride;b+=BOX_COLUMNS) {
+            int e = MIN(b + BOX_COLUMNS, stride), r, j;
+            for (r=1;r<=dataSizeY;r++)
+                for (j=b;j<e;j++) table[r*stride+j] += table[(r-1)*stride+j];
+        }
+        // box sums of the kernel window clipped to the chunk
+        #pragma omp parallel for schedule(static)
+        for (i=0;i<dataSizeY;i++) {
+            const unsigned int *top = table + MAX(i + kCenterY - kernelSizeY + 1, 0)*stride;
+            const unsigned int *bottom = table + MIN(i + kCenterY + 1, dataSizeY)*stride;
+            long o = (long)i*dataSizeX;
+            int j;
+            for (j=0;j<dataSizeX;j++) {
+                int left = MAX(j + kCenterX - kernelSizeX + 1, 0), right = MIN(j + kCenterX + 1, dataSizeX);
+                unsigned int sum = bottom[right] - bottom[left] - top[right] + top[left];
+                SET_SAMPLE(out[ch], o+j, bytes, saturateSum((float)((double)sum * w), maxcolor));
+            }
+        }
+    }
+    free(table);
+    return 0;
+}
+
+int convolveBox2D(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    if(!in || !out || !kern || !kern->box) return -1;
+    if(dataSizeX <= 0) return -1;
+    
+    if (bytes == 1) return convolveBoxSamples(in, out, dataSizeX, dataSizeY, kern, 1, maxcolor);
+    return convolveBoxSamples(in, out, dataSizeX, dataSizeY, kern, 2, maxcolor);
+}
+
+static inline __attribute__((always_inline))
+int convolveGaussianSamples(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    long plane = (long)dataSizeX * dataSizeY, p;
+    float *a = malloc(plane*sizeof(float)), *b = malloc(plane*sizeof(float));
+    struct deriche cx, cy;
+    int ch, l, error = 0;
+    
+    if (a == NULL || b == NULL) { free(a); free(b); return -1; }
+    dericheCoefficients(kern->sigmaX, &cx);
+    dericheCoefficients(kern->sigmaY, &cy);
+    for (ch=0;ch<3;ch++) {
+        #pragma omp parallel for schedule(static)
+        for (p=0;p<plane;p++) a[p] = GET_SAMPLE(in[ch], p, bytes);
+        // Along the columns, GAUSSIAN_LINES columns at once
+        #pragma omp parallel for schedule(static)
+        for (l=0;l<dataSizeX;l+=GAUSSIAN_LINES)
+            dericheLines(a + l, b + l, dataSizeX, dataSizeY, MIN(GAUSSIAN_LINES, dataSizeX - l), &cy, 1);
+        // and along the rows, GAUSSIAN_LINES rows at once transposed so they are filtered as columns,
+        // scaled by the gain of the kernel
+        #pragma omp parallel reduction(|:error)
+        {
+            float *t = malloc(2*(size_t)GAUSSIAN_LINES*dataSizeX*sizeof(float)), *u = t + (size_t)GAUSSIAN_LINES*dataSizeX;
+            int r, j, w;
+            if (t == NULL) error = 1;
+            else {
+                #pragma omp for schedule(static)
+                for (l=0;l<dataSizeY;l+=GAUSSIAN_LINES) {
+                    w = MIN(GAUSSIAN_LINES, dataSizeY - l);
+                    for (r=0;r<w;r++)
+                        for (j=0;j<dataSizeX;j++) t[j*GAUSSIAN_LINES + r] = b[(long)(l+r)*dataSizeX + j];
+                    dericheLines(t, u, GAUSSIAN_LINES, dataSizeX, w, &cx, kern->gain);
+                    for (r=0;r<w;r++)
+                        for (j=0;j<dataSizeX;j++)
+                            SET_SAMPLE(out[ch], (long)(l+r)*dataSizeX + j, bytes, saturateSum(u[j*GAUSSIAN_LINES + r], maxcolor));
+                }
+                free(t);
+            }
+        }
+        if (error) break;
+    }
+    free(a);
+    free(b);
+    return error ? -1 : 0;
+}
+
+int convolveGaussian2D(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    if(!in || !out || !kern || kern->sigmaX <= 0 || kern->sigmaY <= 0) return -1;
+    if(dataSizeX <= 0) return -1;
+    
+    if (bytes == 1) return convolveGaussianSamples(in, out, dataSizeX, dataSizeY, kern, 1, maxcolor);
+    return convolveGaussianSamples(in, out, dataSizeX, dataSizeY, kern, 2, maxcolor);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Fused chain: the stages of a chain applied one after the other, instead of
+// their composed kernel, on strips of output rows. Every stage only computes the
+// rows and columns the next ones need, so the intermediate images are float
+// strips of a few rows, never a full image. They cover the border too: the
+// intermediates are not cut to zero out of the chunk, as the composed kernel
+// sees them, so the result is the one of the composed kernel, with the sums
+// rounded in a different order (a sample can differ by one where a sum falls very
+// close to .5). The stages run on the SIMD engines of convolve2D.
+///////////////////////////////////////////////////////////////////////////////
+#define FUSED_STRIP 64                  // minimum output rows of a strip
+
+// Rows of the strips of a chain: at least twice the rows that the stages add around them
+static int fusedStrip(kernelData kern){
+    int s, rows = 0;
+    for (s=0;s<kern->nstages;s++) rows += kern->stages[s]->kernelY - 1;
+    return MAX(FUSED_STRIP, 2*rows);
+}
+
+static inline __attribute__((always_inline))
+int convolveFusedSamples(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    int S = kern->nstages, strip = fusedStrip(kern), strips = (dataSizeY + strip - 1) / strip;
+    int s, top = 0, left = 0, extraX = 0, extraY = 0, r, error = 0;
+    
+    // Margins of the input of the first stage around the output: the rows and columns above and
+    // on the left, and the ones added on both sides, of all the stages
+    for (s=0;s<S;s++) {
+        kernelData k = kern->stages[s];
+        top += k->kernelY - 1 - k->kernelY/2;
+        left += k->kernelX - 1 - k->kernelX/2;
+        extraY += k->kernelY - 1;
+        extraX += k->kernelX - 1;
+    }
+    
+    #pragma omp parallel reduction(|:error)
+    {
+        // Input of every stage: three planes of strip+extra rows by dataSizeX+extra columns, the extra
+        // rows and columns still to be consumed by that stage and the next ones
+        float **buf = calloc(S, sizeof(float *)), *sums = malloc(3*(size_t)dataSizeX*sizeof(float));
+        int s, ok = buf != NULL && sums != NULL;
+        for (s=0;s<S && ok;s++) {
+            int rest = 0, restX = 0, t;
+            for (t=s;t<S;t++) { rest += kern->stages[t]->kernelY - 1; restX += kern->stages[t]->kernelX - 1; }
+            ok = (buf[s] = malloc(3*(size_t)(strip + rest)*(dataSizeX + restX)*sizeof(float))) != NULL;
+        }
+        if (!ok) error = 1;
+        else {
+            #pragma omp for schedule(dynamic)
+            for (r=0;r<strips;r++) {
+                int r0 = r*strip, rows = MIN(strip, dataSizeY - r0) + extraY, cols = dataSizeX + extraX;
+                long plane = (long)rows*cols;
+                int i, j, ch;
+                // The input of the first stage, zero out of the chunk
+                for (ch=0;ch<3;ch++)
+                    for (i=0;i<rows;i++) {
+                        float *row = buf[0] + ch*plane + (long)i*cols;
+                        int g = r0 - top + i;
+                        memset(row, 0, cols*sizeof(float));
+                        if (g >= 0 && g < dataSizeY)
+                            for (j=0;j<dataSizeX;j++) row[left + j] = GET_SAMPLE(in[ch], (long)g*dataSizeX + j, bytes);
+                    }
+                for (s=0;s<S;s++) {
+                    kernelData k = kern->stages[s];
+                    int kX = k->kernelX, kY = k->kernelY, n = cols - (kX - 1), last = s == S-1;
+                    long outPlane = (long)(rows - (kY - 1)) * n;
+                    sumRowEngine engine = sumRowFor(kX, kY);
+                    for (i=0;i<rows-(kY-1);i++) {
+                        // the input under the tap (0,0) for the output (i,0)
+                        const float *inPos = buf[s] + (long)(i + kY - 1)*cols + kX - 1;
+                        float *o = last ? sums : buf[s+1] + (long)i*n;
+                        long oPlane = last ? dataSizeX : outPlane;
+                        j = engine ? engine(inPos, plane, cols, n, k->vkern, kX, kY, o, oPlane) : 0;
+                        sumRowScalar(inPos, plane, cols, j, n, k->vkern, kX, kY, o, oPlane);
+                        if (last) storeSums(out, (long)(r0 + i)*dataSizeX, sums, dataSizeX, dataSizeX, bytes, maxcolor);
+                    }
+                    rows -= kY - 1;
+                    cols = n;
+                    plane = outPlane;
+                }
+            }
+        }
+        for (s=0;s<S && buf!=NULL;s++) free(buf[s]);
+        free(buf);
+        free(sums);
+    }
+    return error ? -1 : 0;
+}
+
+int convolveFused2D(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    if(!in || !out || !kern || kern->nstages < 2) return -1;
+    if(dataSizeX <= 0) return -1;
+    
+    if (bytes == 1) return convolveFusedSamples(in, out, dataSizeX, dataSizeY, kern, 1, maxcolor);
+    return convolveFusedSamples(in, out, dataSizeX, dataSizeY, kern, 2, maxcolor);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// PLANNER
+// Every method has a cost model, seconds = coefficient * work, for a chunk of X x Y pixels and a
+// kX x kY kernel on the given threads:
+//  - direct:    X*Y*kX*kY multiply-adds of the three channels, split among the threads
+//  - sparse:    X*Y*ntaps multiply-adds, split among the threads (kernels with enough zero taps)
+//  - symmetric: X*Y*(kX*kY + products) additions and multiplies, products being one per group of
+//               mirrored taps, split among the threads (symmetric or antisymmetric kernels)
+//  - separable: X*(Y+kY-1)*kX + X*Y*kY multiply-adds, split among the threads (rank 1 kernels)
+//  - winograd:  X*Y pixels, split among the threads (3x3 kernels)
+//  - fft:       N*N*log2(N) per tile, the tiles of every one of the 4 phases split among the threads
+//  - box:       X*Y pixels, split among the threads (kernels with all the taps equal)
+//  - gaussian:  X*Y pixels, split among the threads (Gaussian kernels within GAUSSIAN_TOLERANCE)
+//  - fused:     the multiply-adds of every stage on the rows and columns of its strips, the strips
+//               split among the threads (chains of kernels)
+//  - integer:   X*Y*kX*kY multiply-adds, split among the threads (integral kernels, samples up to 32767)
+// The coefficients are the defaults below, measured with AVX-512, or the ones of the profile written
+// by --calibrate for the SIMD engine in use. The cheapest method is planned unless one is forced.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+static const char *methodNames[METHODS] = {"direct", "sparse", "symmetric", "separable", "winograd", "fft", "box", "gaussian", "fused", "integer"};
+static double methodCoef[METHODS] = {2.2e-10, 3.5e-10, 1.1e-10, 3.5e-10, 9.0e-9, 1.7e-8, 2.1e-8, 3.8e-8, 3.1e-10, 1.5e-10};
+
+#define PROFILE_NAME ".convolution.profile"
+
+// Calibration profile path: $HOME/.convolution.profile, or the current directory without HOME
+static void profileName(char *name){
+    const char *home = getenv("HOME");
+    if (home != NULL) snprintf(name, PATH_MAX_CACHE, "%s/%s", home, PROFILE_NAME);
+    else snprintf(name, PATH_MAX_CACHE, "%s", PROFILE_NAME);
+}
+
+// Load the coefficients calibrated for the SIMD engine in use, if there are.
+int loadProfile(const char *engine){
+    char name[PATH_MAX_CACHE], isa[32], method[32];
+    double coef;
+    int m, found = 0;
+    FILE *fp;
+    
+    profileName(name);
+    if ((fp = fopen(name, "r")) == NULL) return -1;
+    while (fscanf(fp, "%31s %31s %lf", isa, method, &coef) == 3) {
+        if (strcmp(isa, engine) != 0 || coef <= 0) continue;
+        for (m=0;m<METHODS;m++)
+            if (strcmp(method, methodNames[m]) == 0) { methodCoef[m] = coef; found = 1; }
+    }
+    fclose(fp);
+    return found ? 0 : -1;
+}
+
+// Method by name, -1 if unknown
+int methodByName(const char *name){
+    int m;
+    for (m=0;m<METHODS;m++) if (strcmp(name, methodNames[m]) == 0) return m;
+    return -1;
+}
+
+// Estimated seconds to convolve a dataSizeX x dataSizeY chunk of samples up to maxcolor with the
+// method, < 0 if not possible.
+double methodCost(kernelData kern, int method, int dataSizeX, int dataSizeY, int maxcolor, int threads){
+    double kX = kern->kernelX, kY = kern->kernelY, X = dataSizeX, Y = dataSizeY, rounds, products, work;
+    int n, b, tilesX, tilesY, py, px, s, strip, restX, restY;
+    
+    switch (method) {
+        case METHOD_DIRECT:
+            return methodCoef[method] * X*Y*kX*kY / threads;
+        case METHOD_SPARSE:
+            if (kern->ntaps <= 0) return -1;
+            return methodCoef[method] * X*Y*kern->ntaps / threads;
+        case METHOD_SYMMETRIC:
+            if (kern->hsym || kern->vsym)
+                products = (kern->hsym ? (kern->kernelX + 1) / 2 : kX) * (kern->vsym ? (kern->kernelY + 1) / 2 : kY);
+            else if (kern->psym) products = (kern->kernelX * kern->kernelY + 1) / 2;
+            else return -1;
+            return methodCoef[method] * X*Y*(kX*kY + products) / threads;
+        case METHOD_SEPARABLE:
+            if (!kern->separable) return -1;
+            return methodCoef[method] * (X*(Y+kY-1)*kX + X*Y*kY) / threads;
+        case METHOD_WINOGRAD:
+            if (kern->kernelX != 3 || kern->kernelY != 3) return -1;
+            return methodCoef[method] * X*Y / threads;
+        case METHOD_FFT:
+            if ((n = fftTileSize(MAX(kern->kernelX, kern->kernelY), dataSizeX, dataSizeY)) == 0) return -1;
+            b = n - MAX(kern->kernelX, kern->kernelY) + 1;
+            tilesX = (dataSizeX + b - 1) / b;
+            tilesY = (dataSizeY + b - 1) / b;
+            // Rounds of parallel tiles: the tiles with even and odd rows and columns are different phases
+            rounds = 0;
+            for (py=0;py<2;py++)
+                for (px=0;px<2;px++)
+                    rounds += ceil((double)((tilesY + 1 - py) / 2) * ((tilesX + 1 - px) / 2) / threads);
+            return methodCoef[method] * (double)n*n*log2(n) * rounds;
+        case METHOD_BOX:
+            if (!kern->box) return -1;
+            return methodCoef[method] * X*Y / threads;
+        case METHOD_GAUSSIAN:
+            if (kern->sigmaX <= 0) return -1;
+            return methodCoef[method] * X*Y / threads;
+        case METHOD_FUSED:
+            if (kern->nstages < 2) return -1;
+            // Every stage computes the rows and columns the later stages still need
+            strip = fusedStrip(kern);
+            restX = restY = 0;
+            work = 0;
+            for (s=kern->nstages-1;s>=0;s--) {
+                kernelData k = kern->stages[s];
+                work += (Y + (double)ceil(Y / strip) * restY) * (X + restX) * k->kernelX * k->kernelY;
+                restX += k->kernelX - 1;
+                restY += k->kernelY - 1;
+            }
+            return methodCoef[method] * work / threads;
+        case METHOD_INTEGER:
+            if (!integerPossible(kern, maxcolor)) return -1;
+            return methodCoef[method] * X*Y*kX*kY / threads;
+    }
+    return -1;
+}
+
+// Plan the method for the chunks of the kernel, or use the forced one (>= 0) if it is possible.
+// The estimates are logged to info. The Gaussian method is approximate, so it is only planned
+// when its bound stays under one output level, and otherwise only used when forced.
+int planKernel(kernelData kern, int dataSizeX, int dataSizeY, int maxcolor, int threads, int forced, FILE *info){
+    double cost[METHODS];
+    int m, best = METHOD_DIRECT;
+    
+    fprintf(info, "Plan   :");
+    for (m=0;m<METHODS;m++) {
+        cost[m] = methodCost(kern, m, dataSizeX, dataSizeY, maxcolor, threads);
+        if (cost[m] >= 0) fprintf(info, " %s %.3fs", methodNames[m], cost[m]);
+        if (m == METHOD_GAUSSIAN && GAUSSIAN_TOLERANCE * fabs(kern->gain) * maxcolor >= 1) continue;
+        if (cost[m] >= 0 && cost[m] < cost[best]) best = m;
+    }
+    if (forced >= 0) {
+        if (cost[forced] < 0) {
+            fprintf(info, "\n");
+            fprintf(stderr, "Error: the %s method can not be used with this kernel\n", methodNames[forced]);
+            return -1;
+        }
+        best = forced;
+    }
+    fprintf(info, " -> %s%s\n", methodNames[best], forced >= 0 ? " (forced)" : "");
+    kern->method = best;
+    return 0;
+}
+
+// Time of the fastest of 3 runs of a method on random planes
+static double timeMethod(kernelData kern, int method, void **in, void **out, int X, int Y){
+    struct timeval tim;
+    double best = 0, t;
+    int r;
+    kern->method = method;
+    for (r=0;r<3;r++) {
+        gettimeofday(&tim, NULL);
+        t = tim.tv_sec+(tim.tv_usec/1000000.0);
+        convolveChunk(in, out, X, Y, kern, 1, 255);
+        gettimeofday(&tim, NULL);
+        t = tim.tv_sec+(tim.tv_usec/1000000.0) - t;
+        if (r == 0 || t < best) best = t;
+    }
+    return best;
+}
+
+// Benchmark the methods with the SIMD engine in use and save their coefficients in the profile,
+// replacing the ones of the same engine.
+int calibrate(const char *engine){
+    int X = 1024, Y = 768, threads = omp_get_max_threads(), m, ch, i;
+    int sizes[METHODS] = {15, 15, 15, 31, 3, 63, 31, 31, 7, 15};
+    char name[PATH_MAX_CACHE], line[256];
+    void *in[3], *out[3];
+    char *keep = NULL;
+    size_t keeplen = 0;
+    FILE *fp;
+    
+    srand(1);
+    for (ch=0;ch<3;ch++) {
+        in[ch] = malloc((size_t)X*Y);
+        out[ch] = malloc((size_t)X*Y);
+        if (in[ch] == NULL || out[ch] == NULL) return -1;
+        for (i=0;i<X*Y;i++) ((sample8 *)in[ch])[i] = rand() % 256;
+    }
+    printf("Calibrating the %s engine with %d threads on %dx%d pixels\n", engine, threads, X, Y);
+    for (m=0;m<METHODS;m++) {
+        struct structkernel k;
+        int n = sizes[m];
+        double t, work;
+        memset(&k, 0, sizeof(k));
+        k.kernelX = k.kernelY = n;
+        if ((k.vkern = malloc(n*n*sizeof(float))) == NULL) return -1;
+        // A rank 1 kernel for the separable method, one nonzero tap of 4 for the sparse one, random taps for the others
+        for (i=0;i<n*n;i++) k.vkern[i] = (m == METHOD_SEPARABLE) ? (1 + i/n) * (1 + i%n) / (float)(n*n*n*n) : rand() / (float)RAND_MAX / (n*n);
+        if (m == METHOD_SPARSE) for (i=0;i<n*n;i++) if (i % 4) k.vkern[i] = 0;
+        // and mirrored left-right and top-bottom for the symmetric one
+        if (m == METHOD_SYMMETRIC) for (i=0;i<n*n;i++) k.vkern[i] = k.vkern[MIN(i/n, n-1-i/n)*n + MIN(i%n, n-1-i%n)];
+        // uniform for the box one and a Gaussian of sigma n/8 for the gaussian one
+        if (m == METHOD_BOX) for (i=0;i<n*n;i++) k.vkern[i] = 1.0f / (n*n);
+        if (m == METHOD_GAUSSIAN)
+            for (i=0;i<n*n;i++) k.vkern[i] = expf(-(float)((i/n-n/2)*(i/n-n/2) + (i%n-n/2)*(i%n-n/2)) / (n*n/32.0f));
+        // random integers for the integer one, and a chain of two random kernels for the fused one
+        if (m == METHOD_INTEGER) for (i=0;i<n*n;i++) k.vkern[i] = rand() % 101 - 50;
+        if (m == METHOD_FUSED) {
+            kernelData *stages = calloc(2, sizeof(kernelData));
+            if (stages == NULL) return -1;
+            for (ch=0;ch<2;ch++) {
+                if ((stages[ch] = calloc(1, sizeof(struct structkernel))) == NULL) return -1;
+                stages[ch]->kernelX = stages[ch]->kernelY = n;
+                if ((stages[ch]->vkern = malloc(n*n*sizeof(float))) == NULL) return -1;
+                for (i=0;i<n*n;i++) stages[ch]->vkern[i] = rand() / (float)RAND_MAX / (n*n);
+            }
+            free(k.vkern);
+            if (chainKernels(&k, stages, 2)) return -1;
+        }
+        if (factorKernel(&k) || compileTaps(&k) || integerTaps(&k)) return -1;
+        findSymmetry(&k);
+        findBlur(&k);
+        t = timeMethod(&k, m, in, out, X, Y);
+        // The coefficient that makes the model give the measured time
+        methodCoef[m] = 1;
+        work = methodCost(&k, m, X, Y, 255, threads);
+        methodCoef[m] = t / work;
+        printf("%-10s %dx%d kernel: %.4f s, coefficient %.3e\n", methodNames[m], n, n, t, methodCoef[m]);
+        free(k.vkern); free(k.vcol); free(k.vrow); free(k.spectrum); free(k.twiddle); free(k.bitrev);
+        free(k.tapPos); free(k.tapWeight); free(k.pairs);
+        for (i=0;i<k.nstages;i++) { free(k.stages[i]->vkern); free(k.stages[i]); }
+        free(k.stages);
+    }
+    for (ch=0;ch<3;ch++) { free(in[ch]); free(out[ch]); }
+    
+    // Keep the lines of other engines
+    profileName(name);
+    if ((fp = fopen(name, "r")) != NULL) {
+        FILE *mem = open_memstream(&keep, &keeplen);
+        while (fgets(line, sizeof(line), fp) != NULL)
+            if (strncmp(line, engine, strlen(engine)) != 0 || line[strlen(engine)] != ' ') fputs(line, mem);
+        fclose(mem);
+        fclose(fp);
+    }
+    if ((fp = fopen(name, "w")) == NULL) {
+        perror("Error: ");
+        free(keep);
+        return -1;
+    }
+    if (keep != NULL) fputs(keep, fp);
+    for (m=0;m<METHODS;m++) fprintf(fp, "%s %s %.6e\n", engine, methodNames[m], methodCoef[m]);
+    fclose(fp);
+    free(keep);
+    printf("Profile saved in %s\n", name);
+    return 0;
+}
+
+// Convolve the three planes of a chunk with the method planned for the kernel.
+int convolveChunk(void** in, void** out, int dataSizeX, int dataSizeY, kernelData kern, int bytes, int maxcolor)
+{
+    switch (kern->method) {
+        case METHOD_SPARSE:
+            return convolveSparse2D(in, out, dataSizeX, dataSizeY, kern, bytes, maxcolor);
+        case METHOD_SYMMETRIC:
+            return convolveSymmetric2D(in, out, dataSizeX, dataSizeY, kern, bytes, maxcolor);
+        case METHOD_SEPARABLE:
+            return convolveSeparable2D(in, out, dataSizeX, dataSizeY, kern->vcol, kern->vrow, kern->kernelX, kern->kernelY, bytes, maxcolor);
+        case METHOD_WINOGRAD:
+            return convolveWinograd2D(in, out, dataSizeX, dataSizeY, kern->vkern, bytes, maxcolor);
+        case METHOD_FFT:
+            return convolveFFT2D(in, out, dataSizeX, dataSizeY, kern, bytes, maxcolor);
+        case METHOD_BOX:
+            return convolveBox2D(in, out, dataSizeX, dataSizeY, kern, bytes, maxcolor);
+        case METHOD_GAUSSIAN:
+            return convolveGaussian2D(in, out, dataSizeX, dataSizeY, kern, bytes, maxcolor);
+        case METHOD_FUSED:
+            return convolveFused2D(in, out, dataSizeX, dataSizeY, kern, bytes, maxcolor);
+        case METHOD_INTEGER:
+            return convolveInteger2D(in, out, dataSizeX, dataSizeY, kern, bytes, maxcolor);
+    }
+    return convolve2D(in, out, dataSizeX, dataSizeY, kern->vkern, kern->kernelX, kern->kernelY, bytes, maxcolor);
+}
+
+// Filter bank: every kernel is applied to a strip of rows of the chunk before the next strip, so
+// the input rows are still in cache for all of them. A kernel convolves the strip together with
+// the rows above and below that its taps reach, as it would in the whole chunk, into a strip buffer
+// whose rows of the strip are copied to its output planes out[3*b], out[3*b+1] and out[3*b+2].
+// The rows are the ones of the whole chunk except with fft and gaussian, whose tiles and recursions
+// start at the strip, within their tolerance.
+#define BANK_STRIP_BYTES (256*1024)     // input samples of a strip, about half of an L2 cache
+#define BANK_HALO_SHARE 16              // minimum rows of a strip per row reached above and below it
+
+// Rows of the strips of a bank, and the rows the kernels reach above and below them. A strip fits
+// in the L2 cache, unless the rows convolved again around it would be more than 1/BANK_HALO_SHARE.
+int bankStrip(kernelData *bank, int nbank, int dataSizeX, int bytes, int *top, int *bottom){
+    int b;
+    *top = *bottom = 0;
+    for (b=0;b<nbank;b++) {
+        *top = MAX(*top, bank[b]->kernelY - 1 - bank[b]->kernelY/2);
+        *bottom = MAX(*bottom, bank[b]->kernelY/2);
+    }
+    return MAX(MAX(1, BANK_HALO_SHARE*(*top + *bottom)), BANK_STRIP_BYTES / (3*dataSizeX*bytes));
+}
+
+int convolveBank(void** in, void** out, int dataSizeX, int dataSizeY, kernelData *bank, int nbank, int bytes, int maxcolor)
+{
+    int top, bottom, strip = bankStrip(bank, nbank, dataSizeX, bytes, &top, &bottom);
+    int r0, b, ch, error = 0;
+    void *buf[3] = {NULL, NULL, NULL}, *rows[3];
+    
+    for (ch=0;ch<3;ch++)
+        if ((buf[ch] = malloc((size_t)(strip + top + bottom)*dataSizeX*bytes)) == NULL) error = 1;
+    for (r0=0;r0<dataSizeY && !error;r0+=strip) {
+        int first = MAX(0, r0 - top), last = MIN(dataSizeY, r0 + strip + bottom), n = MIN(strip, dataSizeY - r0);
+        for (ch=0;ch<3;ch++) rows[ch] = PLANE_AT(in[ch], (size_t)first*dataSizeX, bytes);
+        for (b=0;b<nbank && !error;b++) {
+            error = convolveChunk(rows, buf, dataSizeX, last - first, bank[b], bytes, maxcolor);
+            for (ch=0;ch<3 && !error;ch++)
+                memcpy(PLANE_AT(out[3*b+ch], (size_t)r0*dataSizeX, bytes),
+                       PLANE_AT(buf[ch], (size_t)(r0 - first)*dataSizeX, bytes), (size_t)n*dataSizeX*bytes);
+        }
+    }
+    for (ch=0;ch<3;ch++) free(buf[ch]);
+    return error ? -1 : 0;
+}
+
+// Halo rows, pixels to read and offset of the first pixel to store for the partition c.
+// The first and the last partitions only have the halo on one side.
+void chunkGeometry(int c, int partitions, int halo, int ancho, int partsize, int *halosize, int *chunksize, int *offset){
+    if (c==0) {
+        *halosize  = halo/2;
+        *chunksize = partsize + (ancho*(*halosize));
+        *offset    = 0;
+    }
+    else if(c<partitions-1) {
+        *halosize  = halo;
+        *chunksize = partsize + (ancho*(*halosize));
+        *offset    = (ancho*halo/2);
+    }
+    else {
+        *halosize  = halo/2;
+        *chunksize = partsize + (ancho*(*halosize));
+        *offset    = (ancho*halo/2);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// One output row of the 2D convolution for the three channels. rows[ch*kernelSizeY+m]
+// is the input row of the channel ch under the kernel row m, that is the row
+// i+kCenterY-m for the output row i, or NULL when it is out of the image. The rows
+// are copied as floats in window, with the ghost border of convolve2D, and summed by
+// the engine of convolve2D, so the result is exactly the same. window holds
+// convolveRowWindow floats, zeroed once by the caller.
+///////////////////////////////////////////////////////////////////////////////
+#define ROW_BLOCK 1024                  // columns of a row convolved by a thread at once
+
+size_t convolveRowWindow(int dataSizeX, int kernelSizeX, int kernelSizeY)
+{
+    int kCenterX = kernelSizeX / 2, padX = MAX(kCenterX, kernelSizeX - 1 - kCenterX);
+    return 3 * ((size_t)dataSizeX + 2*padX) * kernelSizeY + 3 * (size_t)dataSizeX;
+}
+
+static inline __attribute__((always_inline))
+int convolveRowSamples(void** rows, void** out, int dataSizeX, float* window, float* kernel, int kernelSizeX, int kernelSizeY,
+                       int bytes, int maxcolor)
+{
+    int j, m, ch;
+    int kCenterX = kernelSizeX / 2, padX = MAX(kCenterX, kernelSizeX - 1 - kCenterX);
+    long stride = dataSizeX + 2*padX, plane = stride * kernelSizeY;
+    float *sums = window + 3*plane;
+    // the kernel row m is the window row kernelSizeY-1-m, under the tap (0,0) of the column 0
+    const float *inPos = window + (long)(kernelSizeY - 1) * stride + padX + kCenterX;
+    sumRowEngine engine = sumRowFor(kernelSizeX, kernelSizeY);
+    
+    for (ch=0; ch<3; ch++)
+        for (m=0; m<kernelSizeY; m++) {
+            float *row = window + ch*plane + (long)(kernelSizeY - 1 - m) * stride + padX;
+            const void *r = rows[ch*kernelSizeY+m];
+            if (r == NULL) memset(row, 0, dataSizeX*sizeof(float));
+            else if (bytes == 1) for (j=0;j<dataSizeX;j++) row[j] = ((const sample8 *)r)[j];
+            else                 for (j=0;j<dataSizeX;j++) row[j] = ((const sample16 *)r)[j];
+        }
+    
+    #pragma omp parallel for schedule(static) if(dataSizeX >= 2*ROW_BLOCK)
+    for(j = 0; j < dataSizeX; j += ROW_BLOCK)
+    {
+        int n = MIN(ROW_BLOCK, dataSizeX - j);
+        int done = engine ? engine(inPos + j, plane, stride, n, kernel, kernelSizeX, kernelSizeY, sums + j, dataSizeX) : 0;
+        sumRowScalar(inPos + j, plane, stride, done, n, kernel, kernelSizeX, kernelSizeY, sums + j, dataSizeX);
+    }
+    storeSums(out, 0, sums, dataSizeX, dataSizeX, bytes, maxcolor);
+    return 0;
+}
+
+int convolveRow(void** rows, void** out, int dataSizeX, float* window, float* kernel, int kernelSizeX, int kernelSizeY, int bytes, int maxcolor)
+{
+    if(!rows || !out || !window || !kernel) return -1;
+    if (bytes == 1) return convolveRowSamples(rows, out, dataSizeX, window, kernel, kernelSizeX, kernelSizeY, 1, maxcolor);
+    return convolveRowSamples(rows, out, dataSizeX, window, kernel, kernelSizeX, kernelSizeY, 2, maxcolor);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// PIPELINED PARTITIONS
+// A reader thread and a writer thread run next to the convolution, which keeps all the OpenMP
+// threads. depth buffer slots rotate between them, so chunk c+1 is read and chunk c-1 is written
+// while chunk c is convolved. A slot is read again only when its previous chunk has been written.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+struct pipeline{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int depth, partitions, halo, partsize;
+    int readed, convolved, written;     // chunks finished by every stage
+    int error;
+    void **in, **out;                   // R, G and B planes of every slot
+    ImagenData source, output;
+    FILE *fpsrc, *fpdst;
+    long position;
+    double tread, tstore;
+};
+
+static double now(){
+    struct timeval tim;
+    gettimeofday(&tim, NULL);
+    return tim.tv_sec+(tim.tv_usec/1000000.0);
+}
+
+// Wait until *counter > c (or an error). Returns the error flag.
+static int waitStage(struct pipeline *pl, int *counter, int c){
+    int error;
+    pthread_mutex_lock(&pl->lock);
+    while (*counter <= c && !pl->error) pthread_cond_wait(&pl->cond, &pl->lock);
+    error = pl->error;
+    pthread_mutex_unlock(&pl->lock);
+    return error;
+}
+
+static void endStage(struct pipeline *pl, int *counter, int error){
+    pthread_mutex_lock(&pl->lock);
+    (*counter)++;
+    if (error) pl->error = 1;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static void *pipelineReader(void *arg){
+    struct pipeline *pl = arg;
+    int c, halosize, chunksize, offset, error;
+    double start;
+    // The OpenMP threads are left to the convolution: the parallel parsing runs on this thread alone
+    omp_set_num_threads(1);
+    for (c=0;c<pl->partitions;c++) {
+        // The slot is free when the chunk depth places before has been written
+        if (waitStage(pl, &pl->written, c - pl->depth)) break;
+        start = now();
+        chunkGeometry(c, pl->partitions, pl->halo, pl->source->ancho, pl->partsize, &halosize, &chunksize, &offset);
+        pl->source->R = pl->in[(c%pl->depth)*3];
+        pl->source->G = pl->in[(c%pl->depth)*3+1];
+        pl->source->B = pl->in[(c%pl->depth)*3+2];
+        error = readImage(pl->source, &pl->fpsrc, chunksize, pl->halo/2, &pl->position);
+        pl->tread += now() - start;
+        endStage(pl, &pl->readed, error);
+    }
+    return NULL;
+}
+
+static void *pipelineWriter(void *arg){
+    struct pipeline *pl = arg;
+    int c, halosize, chunksize, offset, error;
+    double start;
+    // and the formatting of the chunks on this one
+    omp_set_num_threads(1);
+    for (c=0;c<pl->partitions;c++) {
+        if (waitStage(pl, &pl->convolved, c)) break;
+        start = now();
+        chunkGeometry(c, pl->partitions, pl->halo, pl->source->ancho, pl->partsize, &halosize, &chunksize, &offset);
+        pl->output->R = pl->out[(c%pl->depth)*3];
+        pl->output->G = pl->out[(c%pl->depth)*3+1];
+        pl->output->B = pl->out[(c%pl->depth)*3+2];
+        error = savingChunk(pl->output, &pl->fpdst, pl->partsize, offset);
+        pl->tstore += now() - start;
+        endStage(pl, &pl->written, error);
+    }
+    return NULL;
+}
+
+// Process all the partitions with depth buffer slots. The source and output structs lend their
+// planes to the first slot. Stage times are added to tread, tconv and tstore.
+int runPipeline(ImagenData source, ImagenData output, FILE *fpsrc, FILE *fpdst, kernelData kern,
+                int partitions, int halo, int depth, long position, double *tread, double *tconv, double *tstore){
+    struct pipeline pl;
+    pthread_t reader, writer;
+    int c, s, halosize, chunksize, offset, error = 0;
+    int chunk = source->ancho*source->altura/partitions + source->ancho*halo;
+    struct imagenppm src, dst;
+    double start;
+    
+    memset(&pl, 0, sizeof(pl));
+    pl.depth = depth;
+    pl.partitions = partitions;
+    pl.halo = halo;
+    pl.partsize = (source->altura*source->ancho)/partitions;
+    pl.source = source;
+    pl.output = output;
+    pl.fpsrc = fpsrc;
+    pl.fpdst = fpdst;
+    pl.position = position;
+    pl.in = calloc(depth*3, sizeof(void *));
+    pl.out = calloc(depth*3, sizeof(void *));
+    if (pl.in == NULL || pl.out == NULL) return -1;
+    pl.in[0] = source->R;  pl.in[1] = source->G;  pl.in[2] = source->B;
+    pl.out[0] = output->R; pl.out[1] = output->G; pl.out[2] = output->B;
+    for (s=3;s<depth*3;s++) {
+        if ((pl.in[s] = calloc(chunk, sampleBytes(source))) == NULL) return -1;
+        if ((pl.out[s] = calloc(chunk, sampleBytes(source))) == NULL) return -1;
+    }
+    // the slot planes with the image header, which gives the sample size. The header is copied
+    // before the reader and the writer start to move the planes of source and output.
+    src = *source;
+    dst = *output;
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.cond, NULL);
+    pthread_create(&reader, NULL, pipelineReader, &pl);
+    pthread_create(&writer, NULL, pipelineWriter, &pl);
+    
+    for (c=0;c<partitions;c++) {
+        if (waitStage(&pl, &pl.readed, c)) break;
+        start = now();
+        chunkGeometry(c, partitions, halo, source->ancho, pl.partsize, &halosize, &chunksize, &offset);
+        s = (c%depth)*3;
+        src.R = pl.in[s];  src.G = pl.in[s+1];  src.B = pl.in[s+2];
+        dst.R = pl.out[s]; dst.G = pl.out[s+1]; dst.B = pl.out[s+2];
+        duplicateImageChunk(&src, &dst, chunksize);
+        error = convolveChunk(pl.in + s, pl.out + s, source->ancho, (source->altura/partitions)+halosize, kern,
+                              sampleBytes(source), source->maxcolor);
+        *tconv += now() - start;
+        // an error stops the reader and the writer
+        endStage(&pl, &pl.convolved, error);
+        if (error) break;
+    }
+    
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    error = pl.error;
+    pthread_mutex_destroy(&pl.lock);
+    pthread_cond_destroy(&pl.cond);
+    source->R = pl.in[0];  source->G = pl.in[1];  source->B = pl.in[2];
+    output->R = pl.out[0]; output->G = pl.out[1]; output->B = pl.out[2];
+    for (s=3;s<depth*3;s++) {
+        free(pl.in[s]);
+        free(pl.out[s]);
+    }
+    free(pl.in);
+    free(pl.out);
+    *tread += pl.tread;
+    *tstore += pl.tstore;
+    return error ? -1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// STREAMING
+// The image is read in batches of rows into a ring buffer that holds the kernelY rows under the
+// kernel plus one batch. Every output row is convolved as soon as its last input row is read,
+// and output rows are written by batches. Memory is O(ancho * (kernelY + batch)) for any altura.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+int runStreaming(ImagenData source, ImagenData output, FILE *fpsrc, FILE *fpdst, kernelData kern,
+                 long position, double *tread, double *tconv, double *tstore){
+    int ancho = source->ancho, altura = source->altura;
+    int kCenterY = kern->kernelY / 2;
+    int batch = MAX(1, MIN(64, 65536 / ancho));
+    int ringRows = (kern->kernelY + 2*batch - 2) / batch * batch;   // multiple of batch >= kernelY+batch-1
+    int i, m, ch, readRows = 0, error = 0, bytes = sampleBytes(source);
+    void *ring[3], *outRows[3], *out[3], **rows;
+    float *window;
+    double start;
+    
+    rows = malloc(3 * kern->kernelY * sizeof(void *));
+    if (rows == NULL) return -1;
+    window = calloc(convolveRowWindow(ancho, kern->kernelX, kern->kernelY), sizeof(float));
+    if (window == NULL) return -1;
+    for (ch=0;ch<3;ch++) {
+        if ((ring[ch] = calloc((size_t)ringRows*ancho, bytes)) == NULL) return -1;
+        if ((outRows[ch] = calloc((size_t)batch*ancho, bytes)) == NULL) return -1;
+    }
+    
+    for (i=0; i<altura && !error; i++) {
+        // Read until the last row under the kernel for the output row i
+        start = now();
+        while (readRows <= MIN(i + kCenterY, altura - 1) && !error) {
+            int n = MIN(batch, altura - readRows);
+            size_t at = (size_t)(readRows % ringRows) * ancho;
+            source->R = PLANE_AT(ring[0], at, bytes);
+            source->G = PLANE_AT(ring[1], at, bytes);
+            source->B = PLANE_AT(ring[2], at, bytes);
+            error = readImage(source, &fpsrc, n*ancho, 0, &position);
+            readRows += n;
+        }
+        *tread += now() - start;
+        if (error) break;
+        
+        start = now();
+        for (ch=0; ch<3; ch++) {
+            for (m=0; m<kern->kernelY; m++) {
+                int r = i + kCenterY - m;
+                rows[ch*kern->kernelY+m] = (r >= 0 && r < altura) ? PLANE_AT(ring[ch], (size_t)(r % ringRows) * ancho, bytes) : NULL;
+            }
+            out[ch] = PLANE_AT(outRows[ch], (size_t)(i % batch) * ancho, bytes);
+        }
+        convolveRow(rows, out, ancho, window, kern->vkern, kern->kernelX, kern->kernelY, bytes, source->maxcolor);
+        *tconv += now() - start;
+        
+        // Write a full batch of output rows, or the last one
+        if ((i+1) % batch == 0 || i == altura - 1) {
+            start = now();
+            output->R = outRows[0];
+            output->G = outRows[1];
+            output->B = outRows[2];
+            error = savingChunk(output, &fpdst, (i % batch + 1) * ancho, 0);
+            *tstore += now() - start;
+        }
+    }
+    
+    source->R = source->G = source->B = NULL;
+    output->R = output->G = output->B = NULL;
+    for (ch=0;ch<3;ch++) {
+        free(ring[ch]);
+        free(outRows[ch]);
+    }
+    free(rows);
+    free(window);
+    return error ? -1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// MAIN FUNCTION
+//////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    int i=0,j=0,k=0;
+//    int headstored=0, imagestored=0, stored;
+    const char *engine, *isa=NULL;
+    
+    // Calibration mode: benchmark the convolution methods and save the planner profile
+    if (argc >= 2 && strcmp(argv[1],"--calibrate")==0) {
+        if (argc == 4 && strcmp(argv[2],"-simd")==0) isa = argv[3];
+        if ((engine = selectEngine(isa)) == NULL) {
+            fprintf(stderr,"Error: unknown or unsupported SIMD engine %s\n", isa);
+            return -1;
+        }
+        return calibrate(engine) ? -1 : 0;
+    }
+    if(argc < 5)
+    {
+        printf("Usage: %s <image-file> <kernel-file> <result-file> <partitions> [options]\n", argv[0]);
+        printf("       %s --calibrate [-simd isa]\n", argv[0]);
+        
+        printf("\n\nError, Missing parameters:\n");
+        printf("format: ./serialconvolution image_file kernel_file result_file\n");
+        printf("- image_file : source image path (*.ppm, P3 or P6), - for stdin (implies -stream)\n");
+        printf("- kernel_file: kernel path (text file with 1D kernel matrix), or k1,k2,... to apply a chain of kernels in that order\n");
+        printf("- result_file: result image path (*.ppm), - for stdout\n");
+        printf("- partitions : Image partitions\n");
+        printf("options:\n");
+        printf("- -P3 | -P6  : format of the result image, text or binary (default: the source one)\n");
+        printf("- -cache     : keep the parsed text image in a binary sidecar file (<image-file>.cache)\n");
+        printf("- -pipeline n: read and write partitions while others are convolved, using n buffers\n");
+        printf("- -stream    : convolve row by row with memory independent of the image height (partitions is ignored)\n");
+        printf("- -engine m  : force the convolution method: direct, sparse, symmetric, separable, winograd, fft, box, gaussian, fused or integer (default: planned, not with -stream)\n");
+        printf("- -simd isa  : force the SIMD engine: scalar, SSE4.2, AVX2 or AVX-512 (default: the widest)\n");
+        printf("- -bank k r  : also convolve every chunk, strip by strip, with the kernel file k into the result file r (repeatable)\n");
+        printf("--calibrate  : benchmark the methods on this machine and save the planner profile\n\n");
+        return -1;
+    }
+    
+    //////////////////////////////////////////////////////////////////////////////////////////////////
+    // READING IMAGE HEADERS, KERNEL Matrix, DUPLICATE IMAGE DATA, OPEN RESULTING IMAGE FILE
+    //////////////////////////////////////////////////////////////////////////////////////////////////
+    int imagesize, partitions, partsize, chunksize, halo, halosize;
+    int outformat=0, usecache=0, depth=0, stream=0, method=-1, nbank=1, b, rows;
+    long position=0, storeposition=0;
+    void *inPlanes[3], **bankPlanes = NULL;
+    double start, tstart=0, tend=0, tread=0, tcopy=0, tconv=0, tstore=0, treadk=0;
+    struct timeval tim;
+    FILE *fpsrc=NULL,*fpdst=NULL;
+    ImagenData source=NULL, output=NULL;
+    // Filter bank: the kernel and result files of argv plus the ones of every -bank option. Every chunk
+    // is read once and convolved with all the kernels while it is in memory.
+    char **kernelFiles = calloc(argc, sizeof(char *)), **resultFiles = calloc(argc, sizeof(char *));
+    kernelData *bank = calloc(argc, sizeof(kernelData));
+    bankPlanes = calloc(3*argc, sizeof(void *));
+    ImagenData *outputs = calloc(argc, sizeof(ImagenData));
+    FILE **fpdsts = calloc(argc, sizeof(FILE *));
+    if (!kernelFiles || !resultFiles || !bank || !bankPlanes || !outputs || !fpdsts) return -1;
+    kernelFiles[0] = argv[2];
+    resultFiles[0] = argv[3];
+
+    // Store number of partitions
+    partitions = atoi(argv[4]);
+    // Statistics go to stderr when the result image is written to stdout
+    FILE *info = strcmp(argv[3],"-") ? stdout : stderr;
+    // Optional arguments
+    for (i=5;i<argc;i++) {
+        if (strcmp(argv[i],"-P3")==0) outformat=3;
+        else if (strcmp(argv[i],"-P6")==0) outformat=6;
+        else if (strcmp(argv[i],"-cache")==0) usecache=1;
+        else if (strcmp(argv[i],"-stream")==0) stream=1;
+        else if (strcmp(argv[i],"-pipeline")==0 && i+1<argc && atoi(argv[i+1])>0) depth=atoi(argv[++i]);
+        else if (strcmp(argv[i],"-engine")==0 && i+1<argc && methodByName(argv[i+1])>=0) method=methodByName(argv[++i]);
+        else if (strcmp(argv[i],"-simd")==0 && i+1<argc) isa=argv[++i];
+        else if (strcmp(argv[i],"-bank")==0 && i+2<argc) {
+            kernelFiles[nbank] = argv[++i];
+            resultFiles[nbank++] = argv[++i];
+        }
+        else {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    // stdin can not be read again for the halos of the partitions
+    if (strcmp(argv[1],"-") == 0) stream=1;
+    if (nbank > 1 && (stream || depth > 0)) {
+        fprintf(stderr,"Error: -bank can not be combined with -stream, -pipeline or a piped source\n");
+        return -1;
+    }
+    // streaming convolves single rows with the direct method, only the SIMD engine applies
+    if (method >= 0 && stream) {
+        fprintf(stderr,"Error: -engine can not be combined with -stream or a piped source\n");
+        return -1;
+    }
+    if ((engine = selectEngine(isa)) == NULL) {
+        fprintf(stderr,"Error: unknown or unsupported SIMD engine %s\n", isa);
+        return -1;
+    }
+    loadProfile(engine);
+    ////////////////////////////////////////
+    //Reading kernel matrix
+    gettimeofday(&tim, NULL);
+    start = tim.tv_sec+(tim.tv_usec/1000000.0);
+    tstart = start;
+    kernelData kern=NULL;
+    for (b=0;b<nbank;b++)
+        if ( (bank[b] = leerKernel(kernelFiles[b]))==NULL) {
+            //        free(source);
+            //        free(output);
+            return -1;
+        }
+    kern = bank[0];
+    //The matrix kernel define the halo size to use with the image, the tallest kernel of the bank.
+    //The halo is zero when the image is not partitioned.
+    halo = 0;
+    if (partitions!=1)
+        for (b=0;b<nbank;b++) halo = MAX(halo, (bank[b]->kernelY/2)*2);
+    gettimeofday(&tim, NULL);
+    treadk = treadk + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+
+    ////////////////////////////////////////
+    //Reading Image Header. Image properties: Magical number, comment, size and color resolution.
     gettimeofday(&tim, NULL);
     start = tim.tv_sec+(tim.tv_usec/1000000.0);
-    if ( (output = duplicateImageData(source, partitions, halo)) == NULL) {
+    //Memory allocation based on number of partitions and halo size.
+    if ( (source = initimage(argv[1], &fpsrc, stream ? 0 : partitions, halo, usecache)) == NULL) {
         return -1;
     }
+    // A named pipe or a process substitution can not be read again either: it is streamed
+    if (source->pipe && !stream) {
+        if (nbank > 1 || method >= 0) {
+            fprintf(stderr,"Error: -bank and -engine can not be combined with a piped source\n");
+            return -1;
+        }
+        stream = 1;
+        free(source->R);
+        free(source->G);
+        free(source->B);
+        source->R = source->G = source->B = NULL;
+    }
+    gettimeofday(&tim, NULL);
+    tread = tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+    
+    //Duplicate the image struct.
+    gettimeofday(&tim, NULL);
+    start = tim.tv_sec+(tim.tv_usec/1000000.0);
+    for (b=0;b<nbank;b++) {
+        if ( (outputs[b] = duplicateImageData(source, stream ? 0 : partitions, halo)) == NULL) {
+            return -1;
+        }
+        if (outformat) outputs[b]->P = outformat;
+    }
+    output = outputs[0];
     gettimeofday(&tim, NULL);
     tcopy = tcopy + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
     
+    //Plan the convolution method for the chunks. Streaming convolves single rows directly.
+    if (stream) kern->method = METHOD_DIRECT;
+    else {
+        // A bank convolves strips of rows of the chunks, see convolveBank
+        int top, bottom;
+        rows = source->altura/partitions + halo;
+        if (nbank > 1) rows = MIN(rows, bankStrip(bank, nbank, source->ancho, sampleBytes(source), &top, &bottom) + top + bottom);
+        for (b=0;b<nbank;b++)
+            if (planKernel(bank[b], source->ancho, rows, source->maxcolor, omp_get_max_threads(), method, info)) return -1;
+    }
+    
     ////////////////////////////////////////
     //Initialize Image Storing file. Open the file and store the image header.
     gettimeofday(&tim, NULL);
     start = tim.tv_sec+(tim.tv_usec/1000000.0);
-    if (initfilestore(output, &fpdst, argv[3], &position)!=0) {
-        perror("Error: ");
-        //        free(source);
-        //        free(output);
-        return -1;
-    }
+    for (b=0;b<nbank;b++)
+        if (initfilestore(outputs[b], &fpdsts[b], resultFiles[b], &storeposition)!=0) {
+            perror("Error: ");
+            //        free(source);
+            //        free(output);
+            return -1;
+        }
+    fpdst = fpdsts[0];
     gettimeofday(&tim, NULL);
     tstore = tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
 
@@ -401,29 +3613,32 @@ int main(int argc, char **argv)
     // CHUNK READING
     //////////////////////////////////////////////////////////////////////////////////////////////////
     int c=0, offset=0;
+    position  = source->body;
     imagesize = source->altura*source->ancho;
     partsize  = (source->altura*source->ancho)/partitions;
 //    printf("%s ocupa %dx%d=%d pixels. Partitions=%d, halo=%d, partsize=%d pixels\n", argv[1], source->altura, source->ancho, imagesize, partitions, halo, partsize);
+    //Streaming: the image is convolved row by row instead of by partitions.
+    if (stream) {
+        if (runStreaming(source, output, fpsrc, fpdst, kern, position, &tread, &tconv, &tstore)) {
+            fprintf(stderr,"Error: the streaming convolution failed\n");
+            return -1;
+        }
+        c = partitions;
+    }
+    //Pipelined partitions: the whole loop below runs overlapped in runPipeline.
+    else if (depth > 0) {
+        if (runPipeline(source, output, fpsrc, fpdst, kern, partitions, halo, depth, position, &tread, &tconv, &tstore)) {
+            fprintf(stderr,"Error: the pipelined convolution failed\n");
+            return -1;
+        }
+        c = partitions;
+    }
     while (c < partitions) {
         ////////////////////////////////////////////////////////////////////////////////
         //Reading Next chunk.
         gettimeofday(&tim, NULL);
         start = tim.tv_sec+(tim.tv_usec/1000000.0);
-        if (c==0) {
-            halosize  = halo/2;
-            chunksize = partsize + (source->ancho*halosize);
-            offset   = 0;
-        }
-        else if(c<partitions-1) {
-            halosize  = halo;
-            chunksize = partsize + (source->ancho*halosize);
-            offset    = (source->ancho*halo/2);
-        }
-        else {
-            halosize  = halo/2;
-            chunksize = partsize + (source->ancho*halosize);
-            offset    = (source->ancho*halo/2);
-        }
+        chunkGeometry(c, partitions, halo, source->ancho, partsize, &halosize, &chunksize, &offset);
         //DEBUG
 //        printf("\nRound = %d, position = %ld, partsize= %d, chunksize=%d pixels\n", c, position, partsize, chunksize);
         
@@ -433,68 +3648,82 @@ int main(int argc, char **argv)
         gettimeofday(&tim, NULL);
         tread = tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
         
-        //Duplicate the image chunk
+        //////////////////////////////////////////////////////////////////////////////////////////////////
+        // CHUNK CONVOLUTION
+        //////////////////////////////////////////////////////////////////////////////////////////////////
+        //Every kernel of the bank convolves the chunk just read
         gettimeofday(&tim, NULL);
         start = tim.tv_sec+(tim.tv_usec/1000000.0);
-        if ( duplicateImageChunk(source, output, chunksize) ) {
+        rows = (source->altura/partitions)+halosize;
+        inPlanes[0] = source->R;  inPlanes[1] = source->G;  inPlanes[2] = source->B;
+        for (b=0;b<nbank;b++) {
+            bankPlanes[3*b] = outputs[b]->R; bankPlanes[3*b+1] = outputs[b]->G; bankPlanes[3*b+2] = outputs[b]->B;
+        }
+        if ((nbank == 1 ? convolveChunk(inPlanes, bankPlanes, source->ancho, rows, kern, sampleBytes(source), source->maxcolor)
+                        : convolveBank(inPlanes, bankPlanes, source->ancho, rows, bank, nbank, sampleBytes(source), source->maxcolor))) {
+            fprintf(stderr,"Error: the convolution of the chunk failed\n");
             return -1;
         }
-        //DEBUG
-//        for (i=0;i<chunksize;i++)
-//            if (source->R[i]!=output->R[i] || source->G[i]!=output->G[i] || source->B[i]!=output->B[i]) printf("At position i=%d %d!=%d,%d!=%d,%d!=%d\n",i,source->R[i],output->R[i], source->G[i],output->G[i],source->B[i],output->B[i]);
         gettimeofday(&tim, NULL);
-        tcopy = tcopy + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        tconv = tconv + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
         
-        //////////////////////////////////////////////////////////////////////////////////////////////////
-        // CHUNK CONVOLUTION
-        //////////////////////////////////////////////////////////////////////////////////////////////////
+        //The pixels of the chunk past its whole convolved rows keep the source samples
         gettimeofday(&tim, NULL);
         start = tim.tv_sec+(tim.tv_usec/1000000.0);
-        
-        convolve2D(source->R, output->R, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-        convolve2D(source->G, output->G, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-        convolve2D(source->B, output->B, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-        
+        if (chunksize > rows*source->ancho)
+            for (b=0;b<nbank;b++)
+                for (i=0;i<3;i++)
+                    memcpy(PLANE_AT(bankPlanes[3*b+i], (size_t)rows*source->ancho, sampleBytes(source)),
+                           PLANE_AT(inPlanes[i], (size_t)rows*source->ancho, sampleBytes(source)),
+                           (size_t)(chunksize - rows*source->ancho)*sampleBytes(source));
         gettimeofday(&tim, NULL);
-        tconv = tconv + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        tcopy = tcopy + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
         
         //////////////////////////////////////////////////////////////////////////////////////////////////
         // CHUNK SAVING
         //////////////////////////////////////////////////////////////////////////////////////////////////
         //Storing resulting image partition.
-        gettimeofday(&tim, NULL);
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
-        if (savingChunk(output, &fpdst, partsize, offset)) {
-            perror("Error: ");
-            //        free(source);
-            //        free(output);
-            return -1;
+        for (b=0;b<nbank;b++) {
+            gettimeofday(&tim, NULL);
+            start = tim.tv_sec+(tim.tv_usec/1000000.0);
+            if (savingChunk(outputs[b], &fpdsts[b], partsize, offset)) {
+                perror("Error: ");
+                //        free(source);
+                //        free(output);
+                return -1;
+            }
+            gettimeofday(&tim, NULL);
+            tstore = tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
         }
-        gettimeofday(&tim, NULL);
-        tstore = tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
         //Next partition
         c++;
     }
 
     fclose(fpsrc);
-    fclose(fpdst);
+    for (b=0;b<nbank;b++) {
+        fclose(fpdsts[b]);
+        freeImagestructure(&outputs[b]);
+    }
     
     freeImagestructure(&source);
-    freeImagestructure(&output);
     
     gettimeofday(&tim, NULL);
     tend = tim.tv_sec+(tim.tv_usec/1000000.0);
     
-    printf("Imatge: %s\n", argv[1]);
-    printf("ISizeX : %d\n", source->ancho);
-    printf("ISizeY : %d\n", source->altura);
-    printf("kSizeX : %d\n", kern->kernelX);
-    printf("kSizeY : %d\n", kern->kernelY);
-    printf("%.6lf seconds elapsed for Reading image file.\n", tread);
-    printf("%.6lf seconds elapsed for copying image structure.\n", tcopy);
-    printf("%.6lf seconds elapsed for Reading kernel matrix.\n", treadk);
-    printf("%.6lf seconds elapsed for make the convolution.\n", tconv);
-    printf("%.6lf seconds elapsed for writing the resulting image.\n", tstore);
-    printf("%.6lf seconds elapsed\n", tend-tstart);
+    fprintf(info, "Imatge: %s\n", argv[1]);
+    fprintf(info, "ISizeX : %d\n", source->ancho);
+    fprintf(info, "ISizeY : %d\n", source->altura);
+    fprintf(info, "kSizeX : %d\n", kern->kernelX);
+    fprintf(info, "kSizeY : %d\n", kern->kernelY);
+    fprintf(info, "Engine : %s, %s convolution\n", engine, methodNames[kern->method]);
+    for (b=1;b<nbank;b++)
+        fprintf(info, "Bank   : %s %dx%d, %s convolution -> %s\n", kernelFiles[b], bank[b]->kernelX, bank[b]->kernelY,
+                methodNames[bank[b]->method], resultFiles[b]);
+    fprintf(info, "%.6lf seconds elapsed for Reading image file.\n", tread);
+    fprintf(info, "%.6lf seconds elapsed for copying image structure.\n", tcopy);
+    fprintf(info, "%.6lf seconds elapsed for Reading kernel matrix.\n", treadk);
+    fprintf(info, "%.6lf seconds elapsed for make the convolution.\n", tconv);
+    fprintf(info, "%.6lf seconds elapsed for writing the resulting image.\n", tstore);
+    fprintf(info, "%.6lf seconds elapsed\n", tend-tstart);
     return 0;
 }
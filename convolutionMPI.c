@@ -17,6 +17,10 @@
 #include <sys/time.h>
 #include <time.h>
 #include <mpi.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #define MAX(a, b)((a > b) ? a : b )  
 #define MIN(a, b)((a < b) ? a : b )  
@@ -50,6 +54,7 @@ int readImage(ImagenData Img, FILE **fp, int dim, int halosize, long int *positi
 int duplicateImageChunk(ImagenData src, ImagenData dst, int dim);
 int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position);
 int savingChunk(ImagenData img, FILE **fp, int dim, int offset);
+int savingBinaryRows(ImagenData img, FILE **fp, int *R, int *G, int *B, int dim, long pixel, long header);
 int convolve2D(int* in, int* out, int dataSizeX, int dataSizeY,
                float* kernel, int kernelSizeX, int kernelSizeY,
                int yFrom, int yTo);
@@ -187,6 +192,42 @@ int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position){
     /*Writing Image Header*/
     fprintf(*fp,"P%d\n%s\n%d %d\n%d\n",img->P,img->comentario,img->ancho,img->altura,img->maxcolor);
     *position = ftell(*fp);
+    // Binary results have a known size: the file is allocated so every worker writes its rows at their offset.
+    if (img->P == 6) {
+        off_t size = *position + (off_t)img->ancho*img->altura*3*(img->maxcolor < 256 ? 1 : 2);
+        fflush(*fp);
+        if (posix_fallocate(fileno(*fp), 0, size) != 0 && ftruncate(fileno(*fp), size) != 0) {
+            perror("Error: ");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write dim pixels as binary (P6) samples at the pixel index pixel of the result file, whose header
+// has header bytes. Samples are saturated to [0, maxcolor] because P6 can not store negatives.
+int savingBinaryRows(ImagenData img, FILE **fp, int *R, int *G, int *B, int dim, long pixel, long header){
+    int i, j, v[3], bytes = (img->maxcolor < 256) ? 1 : 2;
+    size_t len = (size_t)dim*3*bytes, w = 0;
+    unsigned char *buf, *b;
+    
+    if (dim <= 0) return 0;
+    if ((buf = malloc(len)) == NULL) return -1;
+    for (i=0, b=buf; i<dim; i++) {
+        v[0] = R[i]; v[1] = G[i]; v[2] = B[i];
+        for (j=0;j<3;j++) {
+            v[j] = MIN(MAX(v[j], 0), img->maxcolor);
+            if (bytes == 2) *b++ = v[j]>>8;
+            *b++ = v[j]&0xff;
+        }
+    }
+    while (w < len) {
+        ssize_t r = pwrite(fileno(*fp), buf + w, len - w, header + pixel*3*bytes + w);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) { free(buf); return -1; }
+        w += r;
+    }
+    free(buf);
     return 0;
 }
 
@@ -327,9 +368,9 @@ int main(int argc, char **argv)
     int i=0,j=0,k=0;
 //    int headstored=0, imagestored=0, stored;
     
-    if(argc != 6)
+    if(argc != 6 && !(argc == 7 && strcmp(argv[6],"-P6") == 0))
     {
-        printf("Usage: %s <image-file> <kernel-file> <result-file> <partitions> <num-chunks>\n", argv[0]);
+        printf("Usage: %s <image-file> <kernel-file> <result-file> <partitions> <num-chunks> [-P6]\n", argv[0]);
         
         printf("\n\nError, Missing parameters:\n");
         printf("format: ./serialconvolution image_file kernel_file result_file\n");
@@ -337,7 +378,8 @@ int main(int argc, char **argv)
         printf("- kernel_file: kernel path (text file with 1D kernel matrix)\n");
         printf("- result_file: result image path (*.ppm)\n");
         printf("- partitions : Image partitions\n");
-        printf("- num-chunks : Number of chunks to divide the convolution process. If num-chunks is equal to the number of mpi processes minus 1, the program will execute in a static way.\n\n");
+        printf("- num-chunks : Number of chunks to divide the convolution process. If num-chunks is equal to the number of mpi processes minus 1, the program will execute in a static way.\n");
+        printf("- -P6        : binary result, every worker writes its rows in the result file instead of sending them to rank 0\n\n");
         return -1;
     }
     
@@ -345,7 +387,8 @@ int main(int argc, char **argv)
     // READING IMAGE HEADERS, KERNEL Matrix, DUPLICATE IMAGE DATA, OPEN RESULTING IMAGE FILE
     //////////////////////////////////////////////////////////////////////////////////////////////////
     int imagesize, partitions, partsize, chunksize, halo, halosize;
-    long position=0;
+    int binary = (argc == 7);
+    long position=0, header=0;
     double start, tstart=0, tend=0, tread=0, tcopy=0, tconv=0, tstore=0, treadk=0;
     struct timeval tim;
     FILE *fpsrc=NULL,*fpdst=NULL;
@@ -397,6 +440,7 @@ int main(int argc, char **argv)
     //Initialize Image Storing file. Open the file and store the image header.
     gettimeofday(&tim, NULL);
     start = tim.tv_sec+(tim.tv_usec/1000000.0);
+    if (binary) output->P = 6;
     if (initfilestore(output, &fpdst, argv[3], &position)!=0) {
         perror("Error: ");
         //        free(source);
@@ -405,6 +449,7 @@ int main(int argc, char **argv)
     }
     gettimeofday(&tim, NULL);
     tstore = tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+    header = position;
 
     //////////////////////////////////////////////////////////////////////////////////////////////////
     // CHUNK READING
@@ -471,6 +516,8 @@ int main(int argc, char **argv)
         MPI_Comm_rank (MPI_COMM_WORLD, &rank);        // get current process id
         MPI_Comm_size (MPI_COMM_WORLD, &size);        // get number of processes
         MPI_Get_processor_name(hostname, &namelen);   // get CPU name
+        // Every rank has created the result file before any worker writes in it
+        if (binary) MPI_Barrier(MPI_COMM_WORLD);
 
         int workPackageSize = ((source->altura/partitions)+halosize) / num_chunks;
         int workPackageRest = ((source->altura/partitions)+halosize) % num_chunks;
@@ -542,7 +589,19 @@ int main(int argc, char **argv)
                 convolve2D(source->B, outmsg + (2 * recvMaxSize) + 2, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY, inmsg[0], inmsg[1]);
 
 
-                MPI_Isend(outmsg, packageDataSize, MPI_INT, 0, 1, MPI_COMM_WORLD,&send_request);
+                if (binary) {
+                    // Store directly the rows of this package that belong to the partition result
+                    int first = MAX(inmsg[0] * source->ancho, offset);
+                    int last  = MIN(inmsg[1] * source->ancho, offset + partsize);
+                    int skip  = first - inmsg[0] * source->ancho;
+                    if (first < last &&
+                        savingBinaryRows(output, &fpdst, outmsg + 2 + skip, outmsg + recvMaxSize + 2 + skip,
+                                         outmsg + (2 * recvMaxSize) + 2 + skip, last - first,
+                                         (long)c * partsize + first - offset, header)) {
+                        perror("Error: ");
+                    }
+                }
+                else MPI_Isend(outmsg, packageDataSize, MPI_INT, 0, 1, MPI_COMM_WORLD,&send_request);
 
                 MPI_Isend(outmsg, 0, MPI_INT, 0, 0, MPI_COMM_WORLD,&send_request); //need more work
                 MPI_Recv (inmsg, 2, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
@@ -560,7 +619,7 @@ int main(int argc, char **argv)
         // CHUNK SAVING
         //////////////////////////////////////////////////////////////////////////////////////////////////
         //Storing resulting image partition.
-        if(rank == 0){
+        if(rank == 0 && !binary){
             gettimeofday(&tim, NULL);
             start = tim.tv_sec+(tim.tv_usec/1000000.0);
             if (savingChunk(output, &fpdst, partsize, offset)) {